@@ -0,0 +1,142 @@
+/**
+ * libzt benchmark
+ *
+ * Measures how long an event takes to travel from the library's event queue
+ * (where the service, stack and taps post it) to the user's callback.
+ *
+ * No ZeroTier node is started. The callback thread is run on its own and fed
+ * synthetic ZTS_EVENT_NODE_UP events, so only the event delivery path is
+ * measured. Three passes are made:
+ *
+ *   spaced - one event every <interval_us>, the callback thread is idle
+ *            in between (wakeup latency)
+ *   burst  - all events posted back to back (queueing latency)
+ *   poll   - like spaced, but events are retrieved with zts_poll_events()
+ *            and timed with their own timestamps
+ *
+ * It drives the library's internal event queue and callback thread directly,
+ * so unlike the examples it is not limited to ZeroTierSockets.h. Built with
+ * -DBUILD_BENCHMARKS=ON.
+ *
+ * Usage: eventlatency [count] [interval_us]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "ZeroTierSockets.h"
+#include "Events.hpp"
+
+namespace ZeroTier {
+	extern void (*_userEventCallbackFunc)(void *);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static std::vector<Clock::time_point> sentAt;
+static std::vector<double> latencyUs;
+static std::atomic<unsigned int> received(0);
+
+void benchmarkEventCallback(void *msgPtr)
+{
+	const Clock::time_point now = Clock::now();
+	struct zts_callback_msg *msg = (struct zts_callback_msg *)msgPtr;
+	if (msg->eventCode != ZTS_EVENT_NODE_UP || !msg->node) {
+		return;
+	}
+	// The node address carries the event's index
+	const uint64_t i = msg->node->address;
+	latencyUs[i] = std::chrono::duration<double, std::micro>(now - sentAt[i]).count();
+	received++;
+}
+
+void runPass(const char *name, unsigned int count, unsigned int intervalUs)
+{
+	sentAt.assign(count, Clock::time_point());
+	latencyUs.assign(count, 0.0);
+	received = 0;
+	struct zts_node_details nd;
+	memset(&nd, 0, sizeof(nd));
+	for (unsigned int i = 0; i < count; i++) {
+		nd.address = i;
+		sentAt[i] = Clock::now();
+		ZeroTier::_enqueueEvent(ZTS_EVENT_NODE_UP, &nd);
+		if (intervalUs) {
+			std::this_thread::sleep_for(std::chrono::microseconds(intervalUs));
+		}
+	}
+	while (received < count) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::vector<double> v(latencyUs);
+	std::sort(v.begin(), v.end());
+	printf("%-7s n=%u  min=%.1fus  p50=%.1fus  p99=%.1fus  max=%.1fus\n",
+		name, count, v.front(), v[v.size() / 2], v[(v.size() * 99) / 100], v.back());
+}
+
+void runPollPass(const char *name, unsigned int count, unsigned int intervalUs)
+{
+	latencyUs.assign(count, 0.0);
+	received = 0;
+	ZeroTier::_setState(ZTS_STATE_NODE_RUNNING);
+	std::thread pollThread([count]() {
+		struct zts_event events[64];
+		while (received < count) {
+			int n = zts_poll_events(events, 64, 100);
+			const uint64_t now = zts_get_event_clock();
+			for (int i = 0; i < n; i++) {
+				if (events[i].eventCode == ZTS_EVENT_NODE_UP && events[i].hasDetails) {
+					latencyUs[events[i].details.node.address] = (double)(now - events[i].timestamp);
+					received++;
+				}
+			}
+		}
+	});
+	struct zts_node_details nd;
+	memset(&nd, 0, sizeof(nd));
+	for (unsigned int i = 0; i < count; i++) {
+		nd.address = i;
+		ZeroTier::_enqueueEvent(ZTS_EVENT_NODE_UP, &nd);
+		if (intervalUs) {
+			std::this_thread::sleep_for(std::chrono::microseconds(intervalUs));
+		}
+	}
+	pollThread.join();
+	ZeroTier::_clrState(ZTS_STATE_NODE_RUNNING);
+	std::vector<double> v(latencyUs);
+	std::sort(v.begin(), v.end());
+	printf("%-7s n=%u  min=%.1fus  p50=%.1fus  p99=%.1fus  max=%.1fus\n",
+		name, count, v.front(), v[v.size() / 2], v[(v.size() * 99) / 100], v.back());
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = (argc > 1) ? (unsigned int)atoi(argv[1]) : 10000;
+	unsigned int intervalUs = (argc > 2) ? (unsigned int)atoi(argv[2]) : 1000;
+	if (count == 0) {
+		printf("eventlatency [count] [interval_us]\n");
+		exit(0);
+	}
+
+	ZeroTier::_userEventCallbackFunc = benchmarkEventCallback;
+	ZeroTier::_setState(ZTS_STATE_CALLBACKS_RUNNING);
+	std::thread callbackThread([]() { ZeroTier::_runCallbacks(NULL); });
+
+	runPass("spaced", count, intervalUs);
+	// Events beyond ZTS_EVENT_QUEUE_MAX would be dropped, keep the burst below that
+	runPass("burst", std::min(count, (unsigned int)ZTS_EVENT_QUEUE_MAX), 0);
+
+	ZeroTier::_stopCallbackThread();
+	callbackThread.join();
+
+	runPollPass("poll", count, intervalUs);
+	return 0;
+}
@@ -59,6 +59,7 @@ extern "C" {
 #define ZTS_EVENT_NETWORK_READY_IP6        216
 #define ZTS_EVENT_NETWORK_READY_IP4_IP6    217
 #define ZTS_EVENT_NETWORK_DOWN             218
+#define ZTS_EVENT_NETWORK_UPDATE           219
 // Network Stack events
 #define ZTS_EVENT_STACK_UP                 220
 #define ZTS_EVENT_STACK_DOWN               221
@@ -85,6 +86,32 @@ extern "C" {
 #define ZTS_EVENT_ADDR_ADDED_IP6           272
 #define ZTS_EVENT_ADDR_REMOVED_IP6         273
 
+// Event categories (see zts_set_event_mask())
+#define ZTS_EVENT_MASK_NODE                0x01
+#define ZTS_EVENT_MASK_NETWORK             0x02
+#define ZTS_EVENT_MASK_STACK               0x04
+#define ZTS_EVENT_MASK_NETIF               0x08
+#define ZTS_EVENT_MASK_PEER                0x10
+#define ZTS_EVENT_MASK_PATH                0x20
+#define ZTS_EVENT_MASK_ROUTE               0x40
+#define ZTS_EVENT_MASK_ADDR                0x80
+#define ZTS_EVENT_MASK_ALL                 0xFF
+
+// Where the node's state is kept (see zts_set_state_backend())
+#define ZTS_STATE_BACKEND_FILES            0
+#define ZTS_STATE_BACKEND_MEMORY           1
+#define ZTS_STATE_BACKEND_LOG              2
+#define ZTS_STATE_BACKEND_CALLBACKS        3
+
+// Types of state objects (see zts_set_state_callbacks())
+#define ZTS_STATE_OBJECT_IDENTITY_PUBLIC   1
+#define ZTS_STATE_OBJECT_IDENTITY_SECRET   2
+#define ZTS_STATE_OBJECT_PLANET            3
+#define ZTS_STATE_OBJECT_PEER              5
+#define ZTS_STATE_OBJECT_NETWORK_CONFIG    6
+#define ZTS_STATE_OBJECT_PATH_HINTS        7
+#define ZTS_STATE_OBJECT_NEIGHBORS         8
+
 //////////////////////////////////////////////////////////////////////////////
 // Return Error codes                                                       //
 //////////////////////////////////////////////////////////////////////////////
@@ -497,6 +524,17 @@ struct zts_callback_msg
 	struct zts_physical_path *path;
 	struct zts_peer_details *peer;
 	struct zts_addr_details *addr;
+
+	/**
+	 * Sequence number, increases by one for each generated event. A gap
+	 * means events were dropped because the queue was full
+	 */
+	uint64_t seq;
+
+	/**
+	 * Time the event was queued, in microseconds (see zts_get_event_clock())
+	 */
+	uint64_t timestamp;
 };
 
 struct zts_addr_details
@@ -607,6 +645,12 @@ struct zts_network_details
 	 * Array of IPv4 and IPv6 addresses assigned to the node on this network
 	 */
 	struct zts_virtual_network_route routes[ZTS_MAX_NETWORK_ROUTES];
+
+	/**
+	 * Non-zero while the network runs on its cached configuration and the
+	 * controller hasn't confirmed it yet (see zts_allow_provisional_networks())
+	 */
+	uint8_t provisional;
 };
 
 /**
@@ -700,6 +744,44 @@ struct zts_peer_list
 	unsigned long peerCount;
 };
 
+/**
+ * An event retrieved with zts_poll_events(). Unlike zts_callback_msg it
+ * holds a copy of the details, so it stays valid for as long as the
+ * application keeps it
+ */
+struct zts_event
+{
+	/**
+	 * Event identifier
+	 */
+	int16_t eventCode;
+
+	/**
+	 * Whether the member of details matching eventCode is filled in
+	 */
+	uint8_t hasDetails;
+
+	/**
+	 * Sequence number (see zts_callback_msg)
+	 */
+	uint64_t seq;
+
+	/**
+	 * Time the event was queued, in microseconds (see zts_get_event_clock())
+	 */
+	uint64_t timestamp;
+
+	union {
+		struct zts_node_details node;
+		struct zts_network_details network;
+		struct zts_netif_details netif;
+		struct zts_virtual_network_route route;
+		struct zts_physical_path path;
+		struct zts_peer_details peer;
+		struct zts_addr_details addr;
+	} details;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 // ZeroTier Service Controls                                                //
 //////////////////////////////////////////////////////////////////////////////
@@ -749,6 +831,24 @@ ZT_SOCKET_API int ZTCALL zts_allow_network_caching(uint8_t allowed);
  */
 ZT_SOCKET_API int ZTCALL zts_allow_peer_caching(uint8_t allowed);
 
+/**
+ * @brief Enable or disable bringing networks up from their cached configuration (disabled by default)
+ *
+ * After a restart a joined network normally only reports ZTS_EVENT_NETWORK_READY_* once the
+ * node is online. With this enabled, a network with a cached configuration (see
+ * zts_allow_network_caching()) gets its interface and addresses right away and is reported
+ * ready before the node is online, marked provisional in zts_network_details. It is
+ * reconciled once the controller is heard from: a changed configuration replaces the cached
+ * one, a confirmed one stays, and if access was revoked the cached addresses are removed.
+ * ZTS_EVENT_NETWORK_UPDATE is generated when a network stops being provisional.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param enabled Whether or not this feature is enabled
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_allow_provisional_networks(uint8_t allowed);
+
 /**
  * @brief Enable or disable whether the service will read from a local.conf
  *
@@ -759,15 +859,240 @@ ZT_SOCKET_API int ZTCALL zts_allow_peer_caching(uint8_t allowed);
  */
 ZT_SOCKET_API int ZTCALL zts_allow_local_conf(uint8_t allowed);
 
+/**
+ * @brief Set the maximum number of inbound frames delivered to the network stack at once
+ *
+ * Frames arriving from the ZeroTier virtual wire are queued and handed to the stack
+ * in batches so that the stack's core lock is acquired once per batch instead of once
+ * per frame. Larger batches reduce lock overhead at high packet rates, smaller batches
+ * reduce per-frame latency. The default is 64.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param size Maximum number of frames per batch (1 disables batching)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_rx_batch_size(uint16_t size);
+
+/**
+ * @brief Set the number of threads used to decrypt and process incoming ZeroTier packets
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param count Number of worker threads (0 picks one per CPU core, up to ZTS_MAX_WORKER_THREADS)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_worker_thread_count(uint16_t count);
+
+/**
+ * @brief Enable batched physical UDP I/O (disabled by default)
+ *
+ * When enabled the service reads up to size datagrams per system call with recvmmsg()
+ * and coalesces outgoing ZeroTier packets per socket into sendmmsg() calls that are
+ * flushed at the end of each processing pass. This greatly reduces system call overhead
+ * at high packet rates. Only available on Linux, ignored elsewhere.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param size Maximum number of datagrams per system call (0 or 1 disables batching)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_wire_batch_size(uint16_t size);
+
+/**
+ * @brief Spread the primary port's traffic over several sockets and threads (disabled by default)
+ *
+ * Opens count SO_REUSEPORT sockets (per address family) on the primary port, each read by
+ * its own thread which also processes the packets it receives. The kernel hashes flows
+ * across the sockets so busy nodes with many peers can use more than one core for I/O.
+ * Only available on Linux, ignored elsewhere.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param count Number of sockets/threads (0 or 1 disables sharding, up to ZTS_MAX_PORT_SHARDS)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_port_shard_count(uint16_t count);
+
+/**
+ * @brief Enable or disable UDP segmentation offload for ZeroTier packets (disabled by default)
+ *
+ * When enabled, runs of same-size packets to the same destination in a batched send
+ * (see zts_set_wire_batch_size()) are handed to the kernel as one UDP_SEGMENT (GSO) send,
+ * and the primary port shards (see zts_set_port_shard_count()) receive with UDP_GRO and
+ * split the coalesced datagrams back into individual packets. Only available on Linux
+ * 4.18 or later, ignored elsewhere. Falls back to plain sends if the kernel refuses GSO.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param enabled Whether or not this feature is enabled
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_allow_udp_offload(uint8_t allowed);
+
+/**
+ * @brief Set how long updates of cached state (peers, network configs) are held before being written (5000 ms by default)
+ *
+ * State is written by a background thread. Updates of the same object within the interval
+ * are combined into one write, and contents that did not change are not written at all.
+ * Identities are always written right away. Files are replaced atomically.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param interval Interval in milliseconds (0 writes updates as soon as possible)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_state_flush_interval(uint32_t interval);
+
+/**
+ * @brief Select where the node's state (identity, planet, network configs, peers) is kept
+ *
+ * ZTS_STATE_BACKEND_FILES (the default) keeps one file per object in the home path.
+ * ZTS_STATE_BACKEND_MEMORY keeps everything in memory only: nothing is written to disk,
+ * a node restarted within the same process keeps its identity, a new process gets a new one.
+ * ZTS_STATE_BACKEND_LOG keeps everything in a single append-only file (state.log) in the
+ * home path which is read at once on start and compacted as it accumulates stale records.
+ * Falls back to ZTS_STATE_BACKEND_FILES on Windows.
+ * ZTS_STATE_BACKEND_CALLBACKS hands everything to the application (see zts_set_state_callbacks()).
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param backend One of the ZTS_STATE_BACKEND_* constants
+ * @return ZTS_ERR_OK on success. ZTS_ERR_ARG or ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_state_backend(int backend);
+
+/**
+ * @brief Keep the node's state in the application and select ZTS_STATE_BACKEND_CALLBACKS
+ *
+ * Objects are identified by a ZTS_STATE_OBJECT_* type and two ID words (the network ID or
+ * peer address in the first word, zero otherwise). ZTS_STATE_OBJECT_PATH_HINTS (physical
+ * paths of peers) and ZTS_STATE_OBJECT_NEIGHBORS (ARP entries of a network) are written on
+ * stop and read on start to speed up reconnecting, they may be dropped. getFunc copies at most maxlen bytes of
+ * the object into data and returns the number copied, or a negative value if it doesn't
+ * exist. putFunc stores len bytes of data and returns zero, or a negative value on failure.
+ * A negative len (and NULL data) means the object should be removed. Puts come from a
+ * background thread and may overlap with gets from the service thread. Networks are not
+ * rejoined automatically on start with this backend.
+ *
+ * @usage Should be called before zts_start() if you intend on changing its state.
+ *
+ * @param getFunc Function reading an object
+ * @param putFunc Function storing or removing an object
+ * @param arg Passed to both functions
+ * @return ZTS_ERR_OK on success. ZTS_ERR_ARG or ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_set_state_callbacks(
+	int (*getFunc)(void *arg, int type, const uint64_t id[2], void *data, unsigned int maxlen),
+	int (*putFunc)(void *arg, int type, const uint64_t id[2], const void *data, int len),
+	void *arg);
+
+/**
+ * @brief Select which categories of events are generated (all of them by default)
+ *
+ * Events outside of the mask are never generated, so their cost is not paid at all.
+ * For instance clearing ZTS_EVENT_MASK_PEER stops the service from scanning the peer
+ * list every second for ZTS_EVENT_PEER_* events. Peer queries (zts_get_peers() and
+ * others) then fetch the list themselves when their copy is more than a second old.
+ *
+ * @usage May be called at any time.
+ *
+ * @param mask Bitwise OR of ZTS_EVENT_MASK_* values
+ * @return ZTS_ERR_OK
+ */
+ZT_SOCKET_API int ZTCALL zts_set_event_mask(uint64_t mask);
+
+/**
+ * @brief Retrieve queued events from the calling thread
+ *
+ * This is the alternative to an event callback for applications that run
+ * their own event loop: pass a NULL callback to zts_start() and no callback
+ * thread is created, events then wait in the queue until they are polled.
+ *
+ * @usage Only when the service was started without a callback. Events that are
+ * not polled in time are dropped once the queue is full (see zts_callback_msg.seq)
+ *
+ * @param out Array receiving the events
+ * @param max Number of entries in out
+ * @param timeout_ms How long to wait for an event if none is queued (0 returns
+ * immediately, -1 waits until an event arrives or the service stops)
+ * @return Number of events written to out (0 on timeout or if the service is not
+ * running). ZTS_ERR_SERVICE if events are delivered to a callback, ZTS_ERR_ARG on
+ * invalid arguments
+ */
+ZT_SOCKET_API int ZTCALL zts_poll_events(struct zts_event *out, int max, int timeout_ms);
+
+/**
+ * @brief Get a descriptor which is readable while events are queued
+ *
+ * It can be added to an epoll/kqueue/poll set, call zts_poll_events() once it is
+ * readable. The descriptor belongs to libzt and must not be read or closed.
+ *
+ * @usage Only when the service was started without a callback. Not available on Windows
+ *
+ * @return Descriptor. ZTS_ERR_SERVICE if events are delivered to a callback or on
+ * Windows, ZTS_ERR_GENERAL if it could not be created
+ */
+ZT_SOCKET_API int ZTCALL zts_get_event_fd();
+
+/**
+ * @brief Current time of the clock used for event timestamps
+ *
+ * @usage Subtract an event's timestamp to find how long it was queued
+ *
+ * @return Monotonic time in microseconds
+ */
+ZT_SOCKET_API uint64_t ZTCALL zts_get_event_clock();
+
 /**
  * @brief Starts the ZeroTier service and notifies user application of events via callback
  *
  * @param path path directory where configuration files are stored
- * @param callback User-specified callback for ZTS_EVENT_* events
+ * @param callback User-specified callback for ZTS_EVENT_* events, or NULL to
+ * retrieve events with zts_poll_events() instead
  * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure
  */
 ZT_SOCKET_API int ZTCALL zts_start(const char *path, void (*callback)(void *), uint16_t port);
 
+/**
+ * Size of a buffer able to hold any identity generated by zts_generate_identity()
+ */
+#define ZTS_ID_STR_BUF_LEN 384
+
+/**
+ * @brief Generate a new node identity (public and private key pair)
+ *
+ * Generating an identity is deliberately expensive (a memory-hard computation taking
+ * up to a few seconds of CPU). This is what makes the first zts_start() in an empty
+ * home path slow. This function doesn't need the service and may be called from any
+ * number of threads at once, so identities can be made ahead of time or in a background
+ * pool and handed to zts_start_with_identity() later.
+ *
+ * @param key_pair_str Buffer for the identity, as a string including the private key
+ * @param key_buf_len Size of key_pair_str (at least ZTS_ID_STR_BUF_LEN), set to the
+ * length of the identity (without the terminating null)
+ * @return ZTS_ERR_OK on success. ZTS_ERR_ARG on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_generate_identity(char *key_pair_str, unsigned int *key_buf_len);
+
+/**
+ * @brief Start the ZeroTier service with the given identity instead of a stored or new one
+ *
+ * Same as zts_start() except the node uses the given identity (see zts_generate_identity()).
+ * The identity is kept in memory only: it is not written to the home path (or state backend)
+ * and doesn't replace an identity stored there. If the identity collides with another node's
+ * the service restarts with the stored identity, or a newly generated one.
+ *
+ * @param key_pair_str Identity string including the private key
+ * @param key_buf_len Length of key_pair_str
+ * @param path path directory where configuration files are stored
+ * @param callback User-specified callback for ZTS_EVENT_* events, or NULL to
+ * retrieve events with zts_poll_events() instead
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG (also for an invalid identity) on failure
+ */
+ZT_SOCKET_API int ZTCALL zts_start_with_identity(const char *key_pair_str, unsigned int key_buf_len,
+	const char *path, void (*callback)(void *), uint16_t port);
+
 /**
  * @brief Stops the ZeroTier service and brings down all virtual network interfaces
  *
@@ -802,19 +1127,26 @@ ZT_SOCKET_API int ZTCALL zts_free();
 /**
  * @brief Populate a structure with details for a given network
  *
+ * @usage Answered from a copy of the network state taken at the last config change
+ *
  * @param nwid A 16-digit hexadecimal virtual network ID
  * @param nd Pointer to a zts_network_details structure to populate
- * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ * @return ZTS_ERR_OK on success. ZTS_ERR_NO_RESULT if the network has not been joined.
+ * ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
  */
 ZT_SOCKET_API int ZTCALL zts_get_network_details(uint64_t nwid, struct zts_network_details *nd);
 
 /**
  * @brief Populate an array of structures with details for any given number of networks
  *
+ * @usage Answered from a copy of the network state taken at the last config change
+ *
  * @param nds Pointer to an array of zts_network_details structures to populate
  * @param num Number of zts_network_details structures available to copy data into, will be updated
  * to reflect number of structures that were actually populated
- * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
+ * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure. If there are more
+ * networks than num structures, nothing is copied, ZTS_ERR_ARG is returned and num is set to the
+ * number of networks.
  */
 ZT_SOCKET_API int ZTCALL zts_get_all_network_details(struct zts_network_details *nds, int *num);
 
@@ -922,6 +1254,8 @@ ZT_SOCKET_API uint64_t ZTCALL zts_generate_adhoc_nwid_from_range(
 /**
  * @brief Return details of all peers
  *
+ * @usage Answered from a copy of the peer list which is refreshed about once a second
+ *
  * @param pds Pointer to array of zts_peer_details structs to be filled out
  * @param num Length of destination array, will be filled out with actual number
  * of peers that details were available for.
@@ -932,6 +1266,8 @@ ZT_SOCKET_API int ZTCALL zts_get_peers(struct zts_peer_details *pds, uint32_t *n
 /**
  * @brief Return details of a given peer.
  *
+ * @usage Answered from a copy of the peer list which is refreshed about once a second
+ *
  * @param pds Pointer to zts_peer_details struct to be filled out
  * @param peerId ID of peer that the caller wants details of
  * @return ZTS_ERR_OK on success. ZTS_ERR_SERVICE or ZTS_ERR_ARG on failure.
@@ -950,7 +1286,7 @@ ZT_SOCKET_API int ZTCALL zts_get_node_status();
 
 #define ZTS_STATE_NETWORK_NOT_FOUND         ZTS_EVENT_NETWORK_NOT_FOUND
 #define ZTS_STATE_NETWORK_CLIENT_TOO_OLD    ZTS_EVENT_NETWORK_CLIENT_TOO_OLD
-#define ZTS_STATE_NETWORK_REQUESTING_CONFIG ZTS_EVENT_NETWORK_REQUESTING_CONFIG
+#define ZTS_STATE_NETWORK_REQUESTING_CONFIG ZTS_EVENT_NETWORK_REQ_CONFIG
 #define ZTS_STATE_NETWORK_OK                ZTS_EVENT_NETWORK_OK
 #define ZTS_STATE_NETWORK_ACCESS_DENIED     ZTS_EVENT_NETWORK_ACCESS_DENIED
 #define ZTS_STATE_NETWORK_DOWN              ZTS_EVENT_NETWORK_DOWN
@@ -959,7 +1295,8 @@ ZT_SOCKET_API int ZTCALL zts_get_node_status();
  * @brief Return the state of a given network
  *
  * @param nwid Network ID
- * @return ZTS_STATE_NETWORK_OK, ZTS_STATE_NETWORK_REQUESTING_CONFIG, etc
+ * @return ZTS_STATE_NETWORK_OK, ZTS_STATE_NETWORK_REQUESTING_CONFIG, etc. ZTS_ERR_NO_RESULT
+ * if the network has not been joined
  */
 ZT_SOCKET_API int ZTCALL zts_get_network_status(uint64_t nwid);
 
@@ -970,6 +1307,8 @@ ZT_SOCKET_API int ZTCALL zts_get_network_status(uint64_t nwid);
 /**
  * @brief Return the reachability state of a given remote peer
  *
+ * @usage Answered from a copy of the peer list which is refreshed about once a second
+ *
  * @param peerId Remote peer ID
  * @return ZTS_STATE_PEER_DIRECT, ZTS_STATE_PEER_RELAY, or ZTS_STATE_PEER_UNREACHABLE
  */
@@ -1094,6 +1433,58 @@ ZT_SOCKET_API int ZTCALL zts_get_all_stats(struct zts_stats *statsDest);
  */
 ZT_SOCKET_API int ZTCALL zts_get_protocol_stats(int protocolType, void *protoStatsDest);
 
+/**
+ * Maximum number of incoming packet worker threads
+ */
+#define ZTS_MAX_WORKER_THREADS 16
+
+/**
+ * Maximum number of primary port shards
+ */
+#define ZTS_MAX_PORT_SHARDS 16
+
+/** Incoming packet worker stats */
+struct zts_stats_worker {
+	uint64_t packets;          /* Wire packets processed. */
+	uint64_t bytes;            /* Wire bytes processed.   */
+};
+
+/** ZeroTier service stats */
+struct zts_stats_service {
+	/** Number of incoming packet worker threads */
+	uint32_t worker_count;
+	/** Per-worker counters, only the first worker_count entries are used */
+	struct zts_stats_worker workers[ZTS_MAX_WORKER_THREADS];
+	/** Number of primary port shard threads */
+	uint32_t shard_count;
+	/** Per-shard counters, only the first shard_count entries are used */
+	struct zts_stats_worker shards[ZTS_MAX_PORT_SHARDS];
+	/** Number of threads currently run by libzt (service, callbacks, stack, workers, shards) */
+	uint32_t thread_count;
+	/** Number of times those threads have woken up, to receive work or to poll */
+	uint64_t wakeups;
+	/** Average wakeups per second since the previous call (0 on the first call) */
+	uint32_t wakeups_per_sec;
+	/** Number of events dropped because too many were waiting to be delivered */
+	uint64_t events_dropped;
+	/** Milliseconds from start until the node first came online (0 if it hasn't yet) */
+	uint32_t time_to_online;
+	/** Milliseconds from start until a network was first ready (0 if none has been yet) */
+	uint32_t time_to_network_ready;
+	/** Milliseconds spent loading cached peers and network configs on start */
+	uint32_t state_load_time;
+	/** Number of cached peers and network configs loaded on start */
+	uint32_t state_objects_loaded;
+};
+
+/**
+ * @brief Populate the given structure with the ZeroTier service's counters
+ *
+ * @param statsDest Structure to fill
+ * @return ZTS_ERR_OK on success. ZTS_ERR_ARG or ZTS_ERR_SERVICE on failure.
+ */
+ZT_SOCKET_API int ZTCALL zts_get_service_stats(struct zts_stats_service *statsDest);
+
 //////////////////////////////////////////////////////////////////////////////
 // Socket API                                                               //
 //////////////////////////////////////////////////////////////////////////////
@@ -23,6 +23,8 @@
 #include "Node.hpp"
 #include "Mutex.hpp"
 #include "OSUtils.hpp"
+#include "Utils.hpp"
+#include "Identity.hpp"
 
 #include "Debug.hpp"
 #include "NodeService.hpp"
@@ -43,7 +45,18 @@ namespace ZeroTier
 	extern void (*_userEventCallbackFunc)(void *);
 	extern uint8_t allowNetworkCaching;
 	extern uint8_t allowPeerCaching;
+	extern uint8_t allowProvisionalNetworks;
 	extern uint8_t allowLocalConf;
+	extern unsigned int rxBatchMaxSize;
+	extern unsigned int incomingPacketConcurrency;
+	extern unsigned int wireBatchSize;
+	extern unsigned int portShardCount;
+	extern uint8_t allowUdpOffload;
+	extern unsigned int stateFlushInterval;
+	extern int stateBackend;
+	extern int (*stateGetCallback)(void *,int,const uint64_t *,void *,unsigned int);
+	extern int (*statePutCallback)(void *,int,const uint64_t *,const void *,int);
+	extern void *stateCallbackArg;
 
 #ifdef SDK_JNI
 	// References to JNI objects and VM kept for future callbacks
@@ -73,6 +86,16 @@ int zts_allow_peer_caching(uint8_t allowed = 1)
 	return ZTS_ERR_SERVICE;
 }
 
+int zts_allow_provisional_networks(uint8_t allowed = 1)
+{
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		allowProvisionalNetworks = allowed;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
 int zts_allow_local_conf(uint8_t allowed = 1)
 {
 	Mutex::Lock _l(serviceLock);
@@ -83,7 +106,172 @@ int zts_allow_local_conf(uint8_t allowed = 1)
 	return ZTS_ERR_SERVICE;
 }
 
+int zts_allow_udp_offload(uint8_t allowed = 1)
+{
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		allowUdpOffload = allowed;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_rx_batch_size(uint16_t size)
+{
+	if (size < 1 || size > ZTS_RX_BATCH_SIZE_MAX) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		rxBatchMaxSize = size;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_worker_thread_count(uint16_t count)
+{
+	if (count > ZTS_MAX_WORKER_THREADS) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		incomingPacketConcurrency = count;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_wire_batch_size(uint16_t size)
+{
+	if (size > ZTS_WIRE_BATCH_SIZE_MAX) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		wireBatchSize = size;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_port_shard_count(uint16_t count)
+{
+	if (count > ZTS_MAX_PORT_SHARDS) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		portShardCount = count;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_state_flush_interval(uint32_t interval)
+{
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		stateFlushInterval = interval;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_state_backend(int backend)
+{
+	if ((backend < ZTS_STATE_BACKEND_FILES)||(backend > ZTS_STATE_BACKEND_CALLBACKS)) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		stateBackend = backend;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_state_callbacks(
+	int (*getFunc)(void *, int, const uint64_t *, void *, unsigned int),
+	int (*putFunc)(void *, int, const uint64_t *, const void *, int),
+	void *arg)
+{
+	if (!getFunc || !putFunc) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if(!service) {
+		stateGetCallback = getFunc;
+		statePutCallback = putFunc;
+		stateCallbackArg = arg;
+		stateBackend = ZTS_STATE_BACKEND_CALLBACKS;
+		return ZTS_ERR_OK;
+	}
+	return ZTS_ERR_SERVICE;
+}
+
+int zts_set_event_mask(uint64_t mask)
+{
+	_eventMask = mask;
+	return ZTS_ERR_OK;
+}
+
+int zts_poll_events(struct zts_event *out, int max, int timeout_ms)
+{
+	return _pollEvents(out, max, timeout_ms);
+}
+
+int zts_get_event_fd()
+{
+	return _getEventFd();
+}
+
+uint64_t zts_get_event_clock()
+{
+	return _eventClock();
+}
+
+int zts_generate_identity(char *key_pair_str, unsigned int *key_buf_len)
+{
+	if (!key_pair_str || !key_buf_len || *key_buf_len < ZTS_ID_STR_BUF_LEN) {
+		return ZTS_ERR_ARG;
+	}
+	Identity id;
+	id.generate();
+	char idtmp[ZT_IDENTITY_STRING_BUFFER_LENGTH];
+	id.toString(true, idtmp);
+	const unsigned int len = (unsigned int)strlen(idtmp);
+	if (len >= *key_buf_len) {
+		return ZTS_ERR_ARG;
+	}
+	memcpy(key_pair_str, idtmp, len + 1);
+	*key_buf_len = len;
+	Utils::burn(idtmp, sizeof(idtmp));
+	return ZTS_ERR_OK;
+}
+
+static int _startService(const char *path, void (*callback)(void *), uint16_t port, const std::string &identity);
+
 int zts_start(const char *path, void (*callback)(void *), uint16_t port)
+{
+	return _startService(path, callback, port, std::string());
+}
+
+int zts_start_with_identity(const char *key_pair_str, unsigned int key_buf_len,
+	const char *path, void (*callback)(void *), uint16_t port)
+{
+	if (!key_pair_str || !key_buf_len) {
+		return ZTS_ERR_ARG;
+	}
+	const std::string key(key_pair_str, strnlen(key_pair_str, key_buf_len));
+	Identity id;
+	if (!id.fromString(key.c_str()) || !id.hasPrivate() || !id.locallyValidate()) {
+		return ZTS_ERR_ARG;
+	}
+	return _startService(path, callback, port, key);
+}
+
+static int _startService(const char *path, void (*callback)(void *), uint16_t port, const std::string &identity)
 {
 	Mutex::Lock _l(serviceLock);
 	_lwip_driver_init();
@@ -101,10 +289,8 @@ int zts_start(const char *path, void (*callback)(void *), uint16_t port)
 #else
 	_userEventCallbackFunc = callback;
 #endif
-	if (!_isCallbackRegistered()) {
-		// Must have a callback
-		return ZTS_ERR_ARG;
-	}
+	// Without a callback, events are left queued for zts_poll_events()
+	bool useCallbackThread = _isCallbackRegistered();
 	if (!path) {
 		return ZTS_ERR_ARG;
 	}
@@ -115,6 +301,7 @@ int zts_start(const char *path, void (*callback)(void *), uint16_t port)
 
 	params->port = port;
 	params->path = std::string(path);
+	params->identity = identity;
 
 	if (params->path.length() == 0) {
 		return ZTS_ERR_ARG;
@@ -123,29 +310,37 @@ int zts_start(const char *path, void (*callback)(void *), uint16_t port)
 	int err;
 	int retval = ZTS_ERR_OK;
 
-	_setState(ZTS_STATE_CALLBACKS_RUNNING);
+	if (useCallbackThread) {
+		_setState(ZTS_STATE_CALLBACKS_RUNNING);
+	}
 	_setState(ZTS_STATE_NODE_RUNNING);
 
 	// Start the ZT service thread
 #if defined(__WINDOWS__)
 	HANDLE serviceThread = CreateThread(NULL, 0, _runNodeService, (void*)params, 0, NULL);
-	HANDLE callbackThread = CreateThread(NULL, 0, _runCallbacks, NULL, 0, NULL);
+	if (useCallbackThread) {
+		HANDLE callbackThread = CreateThread(NULL, 0, _runCallbacks, NULL, 0, NULL);
+	}
 #else
 	pthread_t service_thread;
 	pthread_t callback_thread;
 	if ((err = pthread_create(&service_thread, NULL, _runNodeService, (void*)params)) != 0) {
 		retval = err;
 	}
-	if ((err = pthread_create(&callback_thread, NULL, _runCallbacks, NULL)) != 0) {
-		retval = err;
+	if (useCallbackThread) {
+		if ((err = pthread_create(&callback_thread, NULL, _runCallbacks, NULL)) != 0) {
+			retval = err;
+		}
 	}
 #endif
 #if defined(__linux__)
 	pthread_setname_np(service_thread, ZTS_SERVICE_THREAD_NAME);
-	pthread_setname_np(callback_thread, ZTS_EVENT_CALLBACK_THREAD_NAME);
+	if (useCallbackThread) {
+		pthread_setname_np(callback_thread, ZTS_EVENT_CALLBACK_THREAD_NAME);
+	}
 #endif
 	if (retval != ZTS_ERR_OK) {
-		_clrState(ZTS_STATE_CALLBACKS_RUNNING);
+		_stopCallbackThread();
 		_clrState(ZTS_STATE_NODE_RUNNING);
 		_clearRegisteredCallback();
 		//delete params;
@@ -235,9 +430,7 @@ int zts_restart()
 	}
 	// Start again with same parameters as initial call
 	serviceLock.unlock();
-	while (service) {
-		zts_delay_ms(ZTS_CALLBACK_PROCESSING_INTERVAL);
-	}
+	_waitForNodeServiceExit();
 	/* Some of the logic in Java_com_zerotier_libzt_ZeroTier_start
 	is replicated here */
 #ifdef SDK_JNI
@@ -257,13 +450,19 @@ JNIEXPORT void JNICALL Java_com_zerotier_libzt_ZeroTier_restart(
 
 int zts_free()
 {
-	Mutex::Lock _l(serviceLock);
-	if (_getState(ZTS_STATE_FREE_CALLED)) {
-		return ZTS_ERR_SERVICE;
+	{
+		Mutex::Lock _l(serviceLock);
+		if (_getState(ZTS_STATE_FREE_CALLED)) {
+			return ZTS_ERR_SERVICE;
+		}
+		_setState(ZTS_STATE_FREE_CALLED);
 	}
-	_setState(ZTS_STATE_FREE_CALLED);
-	return zts_stop();
-	// TODO: add stack shutdown logic
+	int err = zts_stop();
+	// Only once the service has removed its taps, so STACK_DOWN follows NODE_DOWN.
+	// Also when the service was not running. lwIP's own tcpip thread is never stopped
+	_waitForNodeServiceExit();
+	_lwip_driver_shutdown();
+	return err;
 }
 #ifdef SDK_JNI
 JNIEXPORT void JNICALL Java_com_zerotier_libzt_ZeroTier_free(
@@ -307,11 +506,12 @@ JNIEXPORT jint JNICALL Java_com_zerotier_libzt_ZeroTier_get_1node_1status(
 
 int zts_get_network_status(uint64_t networkId)
 {
-	Mutex::Lock _l(serviceLock);
 	if (!networkId) {
 		return ZTS_ERR_ARG;
 	}
-	if (!_canPerformServiceOperation()) {
+	// Served from the network snapshot, without serviceLock
+	std::shared_ptr<const NetworkSnapshot> snapshot(_getNetworkSnapshot());
+	if (!snapshot) {
 		return ZTS_ERR_SERVICE;
 	}
 	/*
@@ -320,7 +520,8 @@ int zts_get_network_status(uint64_t networkId)
 		ZTS_EVENT_NETWORK_READY_IP6
 		ZTS_EVENT_NETWORK_READY_IP4_IP6
 	*/
-	return ZTS_ERR_NO_RESULT;
+	const NetworkSnapshot::Network *n = snapshot->get(networkId);
+	return n ? n->status : ZTS_ERR_NO_RESULT;
 }
 #ifdef SDK_JNI
 JNIEXPORT jint JNICALL Java_com_zerotier_libzt_ZeroTier_get_1network_1status(
@@ -330,14 +531,38 @@ JNIEXPORT jint JNICALL Java_com_zerotier_libzt_ZeroTier_get_1network_1status(
 }
 #endif
 
-int zts_get_peer_status(uint64_t peerId)
+/**
+ * Current peer snapshot, fetched anew when the service isn't keeping it up to date
+ *
+ * The service only scans peers while ZTS_EVENT_MASK_PEER is set, otherwise
+ * a snapshot older than ZTS_PEER_CHECK_INTERVAL is refreshed here.
+ */
+static std::shared_ptr<const PeerSnapshot> _currentPeerSnapshot()
 {
+	std::shared_ptr<const PeerSnapshot> snapshot(_getPeerSnapshot());
+	if (snapshot && (_isEventEnabled(ZTS_EVENT_MASK_PEER)
+		|| ((OSUtils::now() - snapshot->timestamp) < ZTS_PEER_CHECK_INTERVAL))) {
+		return snapshot;
+	}
 	Mutex::Lock _l(serviceLock);
-	int retval = ZTS_ERR_OK;
-	if (!_canPerformServiceOperation()) {
+	if (service) {
+		service->refreshPeerSnapshot();
+	}
+	return _getPeerSnapshot();
+}
+
+int zts_get_peer_status(uint64_t peerId)
+{
+	// Served from the peer snapshot, without serviceLock while it is current
+	std::shared_ptr<const PeerSnapshot> snapshot(_currentPeerSnapshot());
+	if (!snapshot || !snapshot->online) {
 		return ZTS_ERR_SERVICE;
 	}
-	return service->getPeerStatus(peerId);
+	const struct zts_peer_details *pd = snapshot->get(peerId);
+	if (!pd) {
+		return ZTS_EVENT_PEER_UNREACHABLE;
+	}
+	return pd->pathCount > 0 ? ZTS_EVENT_PEER_DIRECT : ZTS_EVENT_PEER_RELAY;
 }
 #ifdef SDK_JNI
 JNIEXPORT jlong JNICALL Java_com_zerotier_libzt_ZeroTier_get_1peer_1status(
@@ -472,29 +697,21 @@ uint64_t zts_generate_adhoc_nwid_from_range(uint16_t startPortOfRange, uint16_t
 
 int zts_get_peers(struct zts_peer_details *pds, uint32_t *num)
 {
-	Mutex::Lock _l(serviceLock);
 	if (!pds || !num) {
 		return ZTS_ERR_ARG;
 	}
-	if (!_canPerformServiceOperation()) {
+	// Served from the peer snapshot, without serviceLock while it is current
+	std::shared_ptr<const PeerSnapshot> snapshot(_currentPeerSnapshot());
+	if (!snapshot || !snapshot->online) {
 		return ZTS_ERR_SERVICE;
 	}
-	ZT_PeerList *pl = service->getNode()->peers();
-	if (pl) {
-		if (*num < pl->peerCount) {
-			service->getNode()->freeQueryResult((void *)pl);
-			return ZTS_ERR_ARG;
-		}
-		*num = pl->peerCount;
-		for(unsigned long i=0;i<pl->peerCount;++i) {
-			memcpy(&(pds[i]), &(pl->peers[i]), sizeof(struct zts_peer_details));
-			for (unsigned int j=0; j<pl->peers[i].pathCount; j++) {
-				memcpy(&(pds[i].paths[j].address),
-					&(pl->peers[i].paths[j].address), sizeof(struct sockaddr_storage));
-			}
-		}
+	if (*num < snapshot->peers.size()) {
+		return ZTS_ERR_ARG;
+	}
+	*num = snapshot->peers.size();
+	if (*num) {
+		memcpy(pds, &(snapshot->peers[0]), *num * sizeof(struct zts_peer_details));
 	}
-	service->getNode()->freeQueryResult((void *)pl);
 	return ZTS_ERR_OK;
 }
 #ifdef SDK_JNI
@@ -502,117 +719,79 @@ int zts_get_peers(struct zts_peer_details *pds, uint32_t *num)
 
 int zts_get_peer(struct zts_peer_details *pd, uint64_t peerId)
 {
-	Mutex::Lock _l(serviceLock);
 	if (!pd || !peerId) {
 		return ZTS_ERR_ARG;
 	}
-	if (!_canPerformServiceOperation()) {
+	// Served from the peer snapshot, without serviceLock while it is current
+	std::shared_ptr<const PeerSnapshot> snapshot(_currentPeerSnapshot());
+	if (!snapshot || !snapshot->online) {
 		return ZTS_ERR_SERVICE;
 	}
-	ZT_PeerList *pl = service->getNode()->peers();
-	int retval = ZTS_ERR_NO_RESULT;
-	if (pl) {
-		for(unsigned long i=0;i<pl->peerCount;++i) {
-			if (pl->peers[i].address == peerId) {
-				memcpy(pd, &(pl->peers[i]), sizeof(struct zts_peer_details));
-				for (unsigned int j=0; j<pl->peers[i].pathCount; j++) {
-					memcpy(&(pd->paths[j].address),
-						&(pl->peers[i].paths[j].address), sizeof(struct sockaddr_storage));
-				}
-				retval = ZTS_ERR_OK;
-				break;
-			}
-		}
+	const struct zts_peer_details *p = snapshot->get(peerId);
+	if (!p) {
+		return ZTS_ERR_NO_RESULT;
 	}
-	service->getNode()->freeQueryResult((void *)pl);
-	return retval;
+	memcpy(pd, p, sizeof(struct zts_peer_details));
+	return ZTS_ERR_OK;
 }
 #ifdef SDK_JNI
 #endif
 
-void _get_network_details_helper(uint64_t nwid, struct zts_network_details *nd)
-{
-	/*
-    socklen_t addrlen;
-    VirtualTap *tap = vtapMap[nwid];
-    nd->nwid = tap->_nwid;
-    nd->mtu = tap->_mtu;
-    // assigned addresses
-    nd->num_addresses = tap->_ips.size() < ZTS_MAX_ASSIGNED_ADDRESSES ? tap->_ips.size() : ZTS_MAX_ASSIGNED_ADDRESSES;
-    for (int j=0; j<nd->num_addresses; j++) {
-        addrlen = tap->_ips[j].isV4() ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-        memcpy(&(nd->addr[j]), &(tap->_ips[j]), addrlen);
-    }
-    // routes
-    nd->num_routes = ZTS_MAX_NETWORK_ROUTES;;
-    service->getRoutes(nwid, (ZT_VirtualNetworkRoute*)&(nd->routes)[0], &(nd->num_routes));
-	*/
-}
-
-void _get_network_details(uint64_t nwid, struct zts_network_details *nd)
-{
-	/*
-    _vtaps_lock.lock();
-    _get_network_details_helper(nwid, nd);
-    _vtaps_lock.unlock();
-	*/
-}
-
-void _get_all_network_details(struct zts_network_details *nds, int *num)
-{
-	/*
-    _vtaps_lock.lock();
-    *num = vtapMap.size();
-    int idx = 0;
-    std::map<uint64_t, VirtualTap*>::iterator it;
-    for (it = vtapMap.begin(); it != vtapMap.end(); it++) {
-        _get_network_details(it->first, &nds[idx]);
-        idx++;
-    }
-    _vtaps_lock.unlock();
-	*/
-}
-
 int zts_get_network_details(uint64_t nwid, struct zts_network_details *nd)
 {
-	/*
-	serviceLock.lock();
-	int retval = ZTS_ERR_OK;
 	if (!nd || nwid == 0) {
-		retval = ZTS_ERR_ARG;
+		return ZTS_ERR_ARG;
 	}
-	if (!service || _freeHasBeenCalled || _serviceIsShuttingDown) {
-		retval = ZTS_ERR_SERVICE;
+	// Served from the network snapshot, without serviceLock
+	std::shared_ptr<const NetworkSnapshot> snapshot(_getNetworkSnapshot());
+	if (!snapshot) {
+		return ZTS_ERR_SERVICE;
 	}
-	if (retval == ZTS_ERR_OK) {
-		_get_network_details(nwid, nd);
+	const NetworkSnapshot::Network *n = snapshot->get(nwid);
+	if (!n) {
+		return ZTS_ERR_NO_RESULT;
 	}
-	serviceLock.unlock();
-	return retval;
-	*/
-	return 0;
+	memcpy(nd, &(n->details), sizeof(struct zts_network_details));
+	return ZTS_ERR_OK;
 }
 #ifdef SDK_JNI
 #endif
 
 int zts_get_all_network_details(struct zts_network_details *nds, int *num)
 {
-	/*
-	serviceLock.lock();
-	int retval = ZTS_ERR_OK;
-	if (!nds || !num) {
-		retval = ZTS_ERR_ARG;
+	if (!nds || !num || *num < 0) {
+		return ZTS_ERR_ARG;
 	}
-	if (!service || _freeHasBeenCalled || _serviceIsShuttingDown) {
-		retval = ZTS_ERR_SERVICE;
+	std::shared_ptr<const NetworkSnapshot> snapshot(_getNetworkSnapshot());
+	if (!snapshot) {
+		return ZTS_ERR_SERVICE;
 	}
-	if (retval == ZTS_ERR_OK) {
-		_get_all_network_details(nds, num);
+	const int count = (int)snapshot->networks.size();
+	if (count > *num) {
+		*num = count; // So the caller knows how much room is needed
+		return ZTS_ERR_ARG;
 	}
-	serviceLock.unlock();
-	return retval;	
-	*/
-	return 0;
+	for (int i=0; i<count; i++) {
+		memcpy(&(nds[i]), &(snapshot->networks[i].details), sizeof(struct zts_network_details));
+	}
+	*num = count;
+	return ZTS_ERR_OK;
+}
+#ifdef SDK_JNI
+#endif
+
+int zts_get_service_stats(struct zts_stats_service *statsDest)
+{
+	if (!statsDest) {
+		return ZTS_ERR_ARG;
+	}
+	Mutex::Lock _l(serviceLock);
+	if (!_canPerformServiceOperation()) {
+		return ZTS_ERR_SERVICE;
+	}
+	memset(statsDest, 0, sizeof(struct zts_stats_service));
+	service->getServiceStats(statsDest);
+	return ZTS_ERR_OK;
 }
 #ifdef SDK_JNI
 #endif
@@ -17,6 +17,19 @@
  * Callback event processing logic
  */
 
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#if !defined(__WINDOWS__)
+	#include <unistd.h>
+	#include <fcntl.h>
+#endif
+#if defined(__linux__)
+	#include <sys/eventfd.h>
+#endif
+
 #include "concurrentqueue.h"
 
 #ifdef SDK_JNI
@@ -32,7 +45,7 @@
 #include "NodeService.hpp"
 
 #define NODE_EVENT_TYPE(code) code >= ZTS_EVENT_NODE_UP && code <= ZTS_EVENT_NODE_NORMAL_TERMINATION
-#define NETWORK_EVENT_TYPE(code) code >= ZTS_EVENT_NETWORK_NOT_FOUND && code <= ZTS_EVENT_NETWORK_DOWN
+#define NETWORK_EVENT_TYPE(code) code >= ZTS_EVENT_NETWORK_NOT_FOUND && code <= ZTS_EVENT_NETWORK_UPDATE
 #define STACK_EVENT_TYPE(code) code >= ZTS_EVENT_STACK_UP && code <= ZTS_EVENT_STACK_DOWN
 #define NETIF_EVENT_TYPE(code) code >= ZTS_EVENT_NETIF_UP && code <= ZTS_EVENT_NETIF_LINK_DOWN
 #define PEER_EVENT_TYPE(code) code >= ZTS_EVENT_PEER_DIRECT && code <= ZTS_EVENT_PEER_UNREACHABLE
@@ -54,36 +67,164 @@ void (*_userEventCallbackFunc)(void *);
 
 moodycamel::ConcurrentQueue<struct ::zts_callback_msg*> _callbackMsgQueue;
 
-void _enqueueEvent(int16_t eventCode, void *arg)
+/**
+ * An event message and storage for its details. The msg pointers refer to
+ * payload, so delivering an event needs no allocation once the pool is warm.
+ */
+struct zts_event_record
+{
+	struct ::zts_callback_msg msg; // Must stay first, see _freeEvent()
+	union {
+		struct zts_node_details node;
+		struct zts_network_details network;
+		struct zts_netif_details netif;
+		struct zts_virtual_network_route route;
+		struct zts_physical_path path;
+		struct zts_peer_details peer;
+		struct zts_addr_details addr;
+	} payload;
+};
+
+// Records not currently queued, grows to at most ZTS_EVENT_QUEUE_MAX records
+moodycamel::ConcurrentQueue<struct zts_event_record*> _eventPool;
+
+// Number of events queued or being delivered, and events dropped because of the limit
+std::atomic<unsigned int> _eventsQueued(0);
+std::atomic<uint64_t> _eventsDropped(0);
+
+std::atomic<uint64_t> _eventMask(ZTS_EVENT_MASK_ALL);
+
+uint64_t _eventCategory(int16_t eventCode)
+{
+	if (NODE_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_NODE; }
+	if (NETWORK_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_NETWORK; }
+	if (STACK_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_STACK; }
+	if (NETIF_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_NETIF; }
+	if (PEER_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_PEER; }
+	if (PATH_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_PATH; }
+	if (ROUTE_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_ROUTE; }
+	if (ADDR_EVENT_TYPE(eventCode)) { return ZTS_EVENT_MASK_ADDR; }
+	return 0;
+}
+
+// The callback thread (or zts_poll_events()) sleeps on this until an event is queued or it is stopped
+std::mutex _callbackWait_m;
+std::condition_variable _callbackWait;
+
+// Assigned to events as they are generated, including those that are then dropped
+std::atomic<uint64_t> _eventSeq(0);
+
+// Readiness descriptor for zts_get_event_fd(), written to once per empty -> non-empty transition
+Mutex _eventFd_m;
+std::atomic<int> _eventFd(-1);
+int _eventFdWrite = -1;
+std::atomic<bool> _eventFdSignalled(false);
+
+uint64_t _eventClock()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void _signalEventFd()
 {
-	struct ::zts_callback_msg *msg = new ::zts_callback_msg();
+#if !defined(__WINDOWS__)
+	if (_eventFd.load() < 0 || _eventFdSignalled.exchange(true)) {
+		return;
+	}
+#if defined(__linux__)
+	uint64_t one = 1;
+	ssize_t n = write(_eventFdWrite, &one, sizeof(one));
+#else
+	uint8_t one = 1;
+	ssize_t n = write(_eventFdWrite, &one, sizeof(one));
+#endif
+	(void)n;
+#endif
+}
 
-	msg->node = NULL;
-	msg->network = NULL;
-	msg->netif = NULL;
-	msg->route = NULL;
-	msg->path = NULL;
-	msg->peer = NULL;
-	msg->addr = NULL;
+static void _clearEventFd()
+{
+#if !defined(__WINDOWS__)
+	int fd = _eventFd.load();
+	if (fd < 0) {
+		return;
+	}
+	// Clear the flag before draining so a concurrent producer either writes
+	// again or its event is seen by the check below
+	_eventFdSignalled = false;
+	uint8_t buf[64];
+	while (read(fd, buf, sizeof(buf)) > 0) { }
+	if (_callbackMsgQueue.size_approx() > 0) {
+		_signalEventFd();
+	}
+#endif
+}
 
+void _enqueueEvent(int16_t eventCode, const void *details)
+{
+	if (!_isEventEnabled(_eventCategory(eventCode))) {
+		return;
+	}
+	uint64_t seq = ++_eventSeq;
+	if (++_eventsQueued > ZTS_EVENT_QUEUE_MAX) {
+		// The application isn't keeping up, don't let the backlog grow
+		--_eventsQueued;
+		++_eventsDropped;
+		return;
+	}
+	struct zts_event_record *r;
+	if (!_eventPool.try_dequeue(r)) {
+		r = new zts_event_record;
+	}
+	struct ::zts_callback_msg *msg = &(r->msg);
+	memset(msg, 0, sizeof(struct ::zts_callback_msg));
 	msg->eventCode = eventCode;
+	msg->seq = seq;
+	msg->timestamp = _eventClock();
 
-	if (NODE_EVENT_TYPE(eventCode)) {
-		msg->node = (struct zts_node_details*)arg;
-	} if (NETWORK_EVENT_TYPE(eventCode)) {
-		msg->network = (struct zts_network_details*)arg;
-	} if (NETIF_EVENT_TYPE(eventCode)) {
-		msg->netif = (struct zts_netif_details*)arg;
-	} if (ROUTE_EVENT_TYPE(eventCode)) {
-		msg->route = (struct zts_virtual_network_route*)arg;
-	} if (PATH_EVENT_TYPE(eventCode)) {
-		msg->path = (struct zts_physical_path*)arg;
-	} if (PEER_EVENT_TYPE(eventCode)) {
-		msg->peer = (struct zts_peer_details*)arg;
-	} if (ADDR_EVENT_TYPE(eventCode)) {
-		msg->addr = (struct zts_addr_details*)arg;
+	if (details) {
+		if (NODE_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.node), details, sizeof(struct zts_node_details));
+			msg->node = &(r->payload.node);
+		} else if (NETWORK_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.network), details, sizeof(struct zts_network_details));
+			msg->network = &(r->payload.network);
+		} else if (NETIF_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.netif), details, sizeof(struct zts_netif_details));
+			msg->netif = &(r->payload.netif);
+		} else if (ROUTE_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.route), details, sizeof(struct zts_virtual_network_route));
+			msg->route = &(r->payload.route);
+		} else if (PATH_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.path), details, sizeof(struct zts_physical_path));
+			msg->path = &(r->payload.path);
+		} else if (PEER_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.peer), details, sizeof(struct zts_peer_details));
+			msg->peer = &(r->payload.peer);
+		} else if (ADDR_EVENT_TYPE(eventCode)) {
+			memcpy(&(r->payload.addr), details, sizeof(struct zts_addr_details));
+			msg->addr = &(r->payload.addr);
+		}
 	}
-    _callbackMsgQueue.enqueue(msg);
+	_callbackMsgQueue.enqueue(msg);
+	_wakeCallbackThread();
+	_signalEventFd();
+}
+
+void _wakeCallbackThread()
+{
+	// Taking the lock orders this with the waiter's check so the wakeup can't be lost
+	{
+		std::lock_guard<std::mutex> _l(_callbackWait_m);
+	}
+	_callbackWait.notify_all();
+}
+
+void _stopCallbackThread()
+{
+	_clrState(ZTS_STATE_CALLBACKS_RUNNING);
+	_wakeCallbackThread();
 }
 
 void _freeEvent(struct ::zts_callback_msg *msg)
@@ -91,13 +232,111 @@ void _freeEvent(struct ::zts_callback_msg *msg)
 	if (!msg) {
 		return;
 	}
-	if (msg->node) { delete msg->node; }
-	if (msg->network) { delete msg->network; }
-	if (msg->netif) { delete msg->netif; }
-	if (msg->route) { delete msg->route; }
-	if (msg->path) { delete msg->path; }
-	if (msg->peer) { delete msg->peer; }
-	if (msg->addr) { delete msg->addr; }
+	// Every message is the first member of a pooled record
+	_eventPool.enqueue(reinterpret_cast<struct zts_event_record *>(msg));
+	--_eventsQueued;
+}
+
+static void _copyEvent(struct ::zts_event *ev, const struct ::zts_callback_msg *msg)
+{
+	ev->eventCode = msg->eventCode;
+	ev->seq = msg->seq;
+	ev->timestamp = msg->timestamp;
+	ev->hasDetails = 1;
+	if (msg->node) {
+		memcpy(&(ev->details.node), msg->node, sizeof(struct zts_node_details));
+	} else if (msg->network) {
+		memcpy(&(ev->details.network), msg->network, sizeof(struct zts_network_details));
+	} else if (msg->netif) {
+		memcpy(&(ev->details.netif), msg->netif, sizeof(struct zts_netif_details));
+	} else if (msg->route) {
+		memcpy(&(ev->details.route), msg->route, sizeof(struct zts_virtual_network_route));
+	} else if (msg->path) {
+		memcpy(&(ev->details.path), msg->path, sizeof(struct zts_physical_path));
+	} else if (msg->peer) {
+		memcpy(&(ev->details.peer), msg->peer, sizeof(struct zts_peer_details));
+	} else if (msg->addr) {
+		memcpy(&(ev->details.addr), msg->addr, sizeof(struct zts_addr_details));
+	} else {
+		ev->hasDetails = 0;
+	}
+}
+
+int _pollEvents(struct ::zts_event *out, int max, int timeout_ms)
+{
+	if (_getState(ZTS_STATE_CALLBACKS_RUNNING)) {
+		// The callback thread owns the queue
+		return ZTS_ERR_SERVICE;
+	}
+	if (!out || max <= 0) {
+		return ZTS_ERR_ARG;
+	}
+	if (timeout_ms != 0 && _callbackMsgQueue.size_approx() == 0) {
+		std::unique_lock<std::mutex> _l(_callbackWait_m);
+		auto ready = [] {
+			return _callbackMsgQueue.size_approx() > 0 || !_getState(ZTS_STATE_NODE_RUNNING);
+		};
+		if (timeout_ms < 0) {
+			_callbackWait.wait(_l, ready);
+		}
+		else {
+			_callbackWait.wait_for(_l, std::chrono::milliseconds(timeout_ms), ready);
+		}
+	}
+	struct ::zts_callback_msg *msgs[64];
+	int count = 0;
+	while (count < max) {
+		size_t want = (size_t)(max - count) < 64 ? (size_t)(max - count) : 64;
+		size_t n = _callbackMsgQueue.try_dequeue_bulk(msgs, want);
+		if (n == 0) {
+			break;
+		}
+		for (size_t i = 0; i < n; i++) {
+			_copyEvent(&(out[count++]), msgs[i]);
+			_freeEvent(msgs[i]);
+		}
+	}
+	_clearEventFd();
+	return count;
+}
+
+int _getEventFd()
+{
+	if (_getState(ZTS_STATE_CALLBACKS_RUNNING)) {
+		return ZTS_ERR_SERVICE;
+	}
+#if defined(__WINDOWS__)
+	return ZTS_ERR_SERVICE;
+#else
+	Mutex::Lock _l(_eventFd_m);
+	if (_eventFd.load() >= 0) {
+		return _eventFd.load();
+	}
+#if defined(__linux__)
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		return ZTS_ERR_GENERAL;
+	}
+	_eventFdWrite = fd;
+#else
+	int fds[2];
+	if (pipe(fds) < 0) {
+		return ZTS_ERR_GENERAL;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	int fd = fds[0];
+	_eventFdWrite = fds[1];
+#endif
+	_eventFd = fd;
+	// Events may already be waiting
+	if (_callbackMsgQueue.size_approx() > 0) {
+		_signalEventFd();
+	}
+	return fd;
+#endif
 }
 
 void _passDequeuedEventToUser(struct ::zts_callback_msg *msg)
@@ -123,12 +362,10 @@ void _passDequeuedEventToUser(struct ::zts_callback_msg *msg)
 			id = msg->peer ? msg->peer->address : 0;
 		}
 		env->CallVoidMethod(objRef, _userCallbackMethodRef, id, msg->eventCode);
-		_freeEvent(msg);
 	}
 #else
 	if (_userEventCallbackFunc) {
 		_userEventCallbackFunc(msg);
-		_freeEvent(msg);
 	}
 #endif
 }
@@ -220,20 +457,27 @@ void *_runCallbacks(void *thread_id)
 #if defined(__APPLE__)
 	pthread_setname_np(ZTS_EVENT_CALLBACK_THREAD_NAME);
 #endif
-	while (_getState(ZTS_STATE_CALLBACKS_RUNNING) || _callbackMsgQueue.size_approx() > 0)
-    {
-        struct ::zts_callback_msg *msg;
-		size_t sz = _callbackMsgQueue.size_approx();
-		for (size_t j = 0; j < sz; j++) {
-			if (_callbackMsgQueue.try_dequeue(msg)) {
-				_callbackLock.lock();
-				_passDequeuedEventToUser(msg);
-				_callbackLock.unlock();
-				delete msg;
-			}
+	_threadCount++;
+	struct ::zts_callback_msg *msg;
+	while (true) {
+		// Deliver everything queued so far
+		while (_callbackMsgQueue.try_dequeue(msg)) {
+			_callbackLock.lock();
+			_passDequeuedEventToUser(msg);
+			_callbackLock.unlock();
+			_freeEvent(msg);
+		}
+		std::unique_lock<std::mutex> _l(_callbackWait_m);
+		if (_callbackMsgQueue.size_approx() > 0) {
+			continue;
 		}
-        zts_delay_ms(ZTS_CALLBACK_PROCESSING_INTERVAL);
-    }
+		if (!_getState(ZTS_STATE_CALLBACKS_RUNNING)) {
+			break;
+		}
+		_callbackWait.wait(_l);
+		_threadWakeups++;
+	}
+	_threadCount--;
 #if SDK_JNI
 	JNIEnv *env;
 	jint rs = jvm->DetachCurrentThread();
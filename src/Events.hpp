@@ -21,6 +21,7 @@
 #define ZT_EVENTS_HPP
 
 #include <string>
+#include <atomic>
 
 #include "ZeroTierSockets.h"
 
@@ -43,14 +44,69 @@ namespace ZeroTier {
 #endif
 
 /**
- * How often callback messages are assembled and/or sent
+ * How often to check whether the service has stopped (see zts_restart())
  */
 #define ZTS_CALLBACK_PROCESSING_INTERVAL 25
 
+/**
+ * Upper limit for the number of events waiting to be delivered, further events are dropped
+ */
+#define ZTS_EVENT_QUEUE_MAX 1024
+
+/**
+ * Number of events dropped because ZTS_EVENT_QUEUE_MAX was reached
+ */
+extern std::atomic<uint64_t> _eventsDropped;
+
+/**
+ * Categories of events that are generated (see zts_set_event_mask())
+ */
+extern std::atomic<uint64_t> _eventMask;
+
+/**
+ * Return the ZTS_EVENT_MASK_* category of an event code
+ */
+uint64_t _eventCategory(int16_t eventCode);
+
+/**
+ * Return whether events of this category are wanted, producers check this before
+ * doing any work to generate them
+ */
+inline bool _isEventEnabled(uint64_t category)
+{
+	return (_eventMask.load(std::memory_order_relaxed) & category) != 0;
+}
+
 /**
  * Enqueue an event to be sent to the user application
+ * - details (a zts_*_details struct matching eventCode, or NULL) is copied into a pooled record
+ */
+void _enqueueEvent(int16_t eventCode, const void *details = NULL);
+
+/**
+ * Wake the callback thread or a thread waiting in zts_poll_events() (called after queueing a message)
+ */
+void _wakeCallbackThread();
+
+/**
+ * Let the callback thread exit once it has delivered all queued messages
+ */
+void _stopCallbackThread();
+
+/**
+ * Dequeue up to max events into out from the caller's thread (see zts_poll_events())
+ */
+int _pollEvents(struct ::zts_event *out, int max, int timeout_ms);
+
+/**
+ * Create (once) and return the event readiness descriptor (see zts_get_event_fd())
+ */
+int _getEventFd();
+
+/**
+ * Monotonic time in microseconds used for event timestamps
  */
-void _enqueueEvent(int16_t eventCode, void *arg);
+uint64_t _eventClock();
 
 /**
  * Send callback message to user application
@@ -58,7 +114,7 @@ void _enqueueEvent(int16_t eventCode, void *arg);
 void _passDequeuedEventToUser(struct ::zts_callback_msg *msg);
 
 /**
- * Free memory occupied by callback structures
+ * Return a delivered message's record to the pool
  */
 void _freeEvent(struct ::zts_callback_msg *msg);
 
@@ -18,6 +18,10 @@
  */
 
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 #include "Debug.hpp"
 #include "Events.hpp"
@@ -37,6 +41,28 @@
 #include "ManagedRoute.hpp"
 #include "InetAddress.hpp"
 #include "BlockingQueue.hpp"
+#include "UdpRing.hpp"
+#include "PrefixTrie.hpp"
+#include "StateBackend.hpp"
+#include "StateCache.hpp"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
 
 #if defined(__WINDOWS__)
 WSADATA wsaData;
@@ -61,6 +87,64 @@ uint8_t allowNetworkCaching;
 uint8_t allowPeerCaching;
 uint8_t allowLocalConf;
 
+// Number of incoming packet worker threads (0 means one per core)
+unsigned int incomingPacketConcurrency = 0;
+
+// Datagrams per recvmmsg()/sendmmsg() call (0 or 1 means no batching)
+unsigned int wireBatchSize = 0;
+
+// Number of SO_REUSEPORT sockets/threads on the primary port (0 or 1 means none)
+unsigned int portShardCount = 0;
+
+// Use UDP_SEGMENT/UDP_GRO for wire packets where possible
+uint8_t allowUdpOffload = 0;
+
+// How long state updates are held before being written (see zts_set_state_flush_interval())
+unsigned int stateFlushInterval = ZTS_STATE_FLUSH_INTERVAL_DEFAULT;
+
+// Bring networks up from their cached config before the controller answers
+uint8_t allowProvisionalNetworks = 0;
+
+// Where state is kept (see zts_set_state_backend() and zts_set_state_callbacks())
+int stateBackend = ZTS_STATE_BACKEND_FILES;
+int (*stateGetCallback)(void *,int,const uint64_t *,void *,unsigned int) = NULL;
+int (*statePutCallback)(void *,int,const uint64_t *,const void *,int) = NULL;
+void *stateCallbackArg = NULL;
+
+#if defined(__linux__)
+// Set on threads that flush their coalesced wire sends themselves
+static thread_local bool _wireSendDeferred = false;
+#endif
+
+std::atomic<uint32_t> _threadCount(0);
+std::atomic<uint64_t> _threadWakeups(0);
+
+// Peers as of the last scan, see publishPeerSnapshot()
+static std::shared_ptr<const PeerSnapshot> _peerSnapshot;
+
+std::shared_ptr<const PeerSnapshot> _getPeerSnapshot()
+{
+	return std::atomic_load(&_peerSnapshot);
+}
+
+void _setPeerSnapshot(const std::shared_ptr<const PeerSnapshot> &snapshot)
+{
+	std::atomic_store(&_peerSnapshot, snapshot);
+}
+
+// Networks as of the last config change, see publishNetworkSnapshot()
+static std::shared_ptr<const NetworkSnapshot> _networkSnapshot;
+
+std::shared_ptr<const NetworkSnapshot> _getNetworkSnapshot()
+{
+	return std::atomic_load(&_networkSnapshot);
+}
+
+void _setNetworkSnapshot(const std::shared_ptr<const NetworkSnapshot> &snapshot)
+{
+	std::atomic_store(&_networkSnapshot, snapshot);
+}
+
 typedef VirtualTap EthernetTap;
 
 static std::string _trimString(const std::string &s)
@@ -93,6 +177,11 @@ static void SnodeVirtualNetworkFrameFunction(ZT_Node *node,void *uptr,void *tptr
 static int SnodePathCheckFunction(ZT_Node *node,void *uptr,void *tptr,uint64_t ztaddr,int64_t localSocket,const struct sockaddr_storage *remoteAddr);
 static int SnodePathLookupFunction(ZT_Node *node,void *uptr,void *tptr,uint64_t ztaddr,int family,struct sockaddr_storage *result);
 static void StapFrameHandler(void *uptr,void *tptr,uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len);
+static void StapTxNotify(void *uptr);
+#ifdef ZTS_IO_URING
+static bool SportShardDatagram(void *arg,int fd,const struct sockaddr_storage *from,const void *data,unsigned int len,unsigned int segSize);
+static void SportShardBatchDone(void *arg);
+#endif
 
 struct NodeServiceIncomingPacket
 {
@@ -103,6 +192,57 @@ struct NodeServiceIncomingPacket
 	uint8_t data[ZT_MAX_MTU];
 };
 
+#if defined(__linux__)
+// Outbound datagrams coalesced for one socket, sent with a single sendmmsg()
+struct NodeServiceSendBatch
+{
+	int fd;
+	unsigned int count;
+	struct mmsghdr msgs[ZTS_WIRE_BATCH_SIZE_MAX];
+	struct iovec iov[ZTS_WIRE_BATCH_SIZE_MAX];
+	struct sockaddr_storage addrs[ZTS_WIRE_BATCH_SIZE_MAX];
+	uint8_t data[ZTS_WIRE_BATCH_SIZE_MAX][ZTS_WIRE_BATCH_SLOT_SIZE];
+	// Messages rebuilt with UDP_SEGMENT, one per run of same-size datagrams to one destination
+	struct mmsghdr gsoMsgs[ZTS_WIRE_BATCH_SIZE_MAX];
+	unsigned int gsoFirst[ZTS_WIRE_BATCH_SIZE_MAX];
+	uint8_t gsoCtrl[ZTS_WIRE_BATCH_SIZE_MAX][CMSG_SPACE(sizeof(uint16_t))];
+};
+
+// Empty batch swapped in for a full one, so the full one can be sent without holding _wireSend_m
+static thread_local std::unique_ptr<NodeServiceSendBatch> _wireSendSpare;
+#endif
+
+// Counters for one incoming packet worker, padded so workers don't share a cache line
+struct NodeServiceWorkerStats
+{
+	std::atomic<uint64_t> packets;
+	std::atomic<uint64_t> bytes;
+	uint8_t pad[64 - (2 * sizeof(std::atomic<uint64_t>))];
+};
+
+#if defined(__linux__)
+// SO_REUSEPORT sockets on the primary port (IPv4 and IPv6) and the thread that reads them
+struct NodeServicePortShard
+{
+	int fd[2];
+	std::thread thread;
+	NodeServiceWorkerStats stats;
+	struct mmsghdr msgs[ZTS_WIRE_BATCH_SIZE_MAX];
+	struct iovec iov[ZTS_WIRE_BATCH_SIZE_MAX];
+	struct sockaddr_storage from[ZTS_WIRE_BATCH_SIZE_MAX];
+	uint8_t ctrl[ZTS_WIRE_BATCH_SIZE_MAX][CMSG_SPACE(sizeof(int))];
+	// rxSlots receive buffers of rxSlotSize bytes (larger and fewer with UDP_GRO)
+	uint8_t *rxbuf;
+	unsigned int rxSlots;
+	unsigned int rxSlotSize;
+#ifdef ZTS_IO_URING
+	// Serves both sockets in place of the poll()/recvmmsg() loop when the kernel allows it
+	UdpRing *ring;
+	void *service;
+#endif
+};
+#endif
+
 class NodeServiceImpl : public NodeService
 {
 public:
@@ -113,6 +253,10 @@ public:
 	const std::string _networksPath;
 	const std::string _moonsPath;
 
+	// State objects are kept here, and written through the cache off the service thread
+	StateBackend *_stateBackend;
+	StateCache _stateCache;
+
 	Phy<NodeServiceImpl *> _phy;
 	Node *_node;
 	bool _updateAutoApply;
@@ -122,8 +266,19 @@ public:
 	unsigned int _tertiaryPort;
 	volatile unsigned int _udpPortPickerCounter;
 
-	//
-	std::map<uint64_t, bool> peerCache;
+	// Last observed state of each peer, compared against on each scan (see generatePeerEventMsgs())
+	struct PeerCacheEntry
+	{
+		bool direct;
+		uint64_t generation; // Scan that last saw the peer, older entries are pruned
+	};
+	Hashtable< uint64_t,PeerCacheEntry > _peerCache;
+	uint64_t _peerCacheGeneration;
+	int64_t _lastPeerCheck;
+
+	// Set while the node exists and may be asked for its peers from other threads (see publishPeerSnapshot())
+	bool _peerScanReady;
+	Mutex _peerScan_m;
 
 	//
 	unsigned long _incomingPacketConcurrency;
@@ -131,6 +286,37 @@ public:
 	BlockingQueue<NodeServiceIncomingPacket *> _incomingPacketQueue;
 	std::vector<std::thread> _incomingPacketThreads;
 	Mutex _incomingPacketMemoryPoolLock,_incomingPacketThreadsLock;
+	std::atomic<unsigned long> _incomingPacketsPending;
+	NodeServiceWorkerStats _workerStats[ZTS_MAX_WORKER_THREADS];
+
+	// Wakeup count and time at the previous getServiceStats() call, for wakeups_per_sec
+	uint64_t _lastWakeupSample;
+	int64_t _lastWakeupSampleTime;
+	Mutex _wakeupSample_m;
+
+	// Startup timing, reported by getServiceStats() (times are 0 until reached)
+	std::atomic<int64_t> _startTime;
+	std::atomic<int64_t> _firstOnlineTime;
+	std::atomic<int64_t> _firstNetworkReadyTime;
+	std::atomic<uint32_t> _stateLoadTime;
+	std::atomic<uint32_t> _stateObjectsLoaded;
+
+#if defined(__linux__)
+	// Batched physical I/O (see zts_set_wire_batch_size())
+	unsigned int _wireBatchSize;
+	std::map<int64_t,NodeServiceSendBatch *> _wireSendBatches;
+	Mutex _wireSend_m; // Guards _wireSendBatches and filling them, never held while sending
+	struct mmsghdr _wireRecvMsgs[ZTS_WIRE_BATCH_SIZE_MAX];
+	struct iovec _wireRecvIov[ZTS_WIRE_BATCH_SIZE_MAX];
+	NodeServiceIncomingPacket *_wireRecvPkts[ZTS_WIRE_BATCH_SIZE_MAX];
+
+	// UDP_SEGMENT/UDP_GRO in use, cleared if the kernel rejects GSO
+	volatile bool _udpOffload;
+
+	// Primary port shards (see zts_set_port_shard_count()), fixed while the threads run
+	std::vector<NodeServicePortShard *> _portShards;
+	int _portShardStopPipe[2];
+#endif
 
 	// Local configuration and memo-ized information from it
 	Hashtable< uint64_t,std::vector<InetAddress> > _v4Hints;
@@ -143,6 +329,15 @@ public:
 	std::vector< std::string > _interfacePrefixBlacklist;
 	Mutex _localConfig_m;
 
+	// Compiled from tap addresses and blacklists on each network config change (see rebuildPathFilter())
+	struct PathFilter
+	{
+		PrefixTrie pathReject; // Networks assigned to our taps and the global blacklists
+		PrefixTrie bindReject; // Addresses of our taps and the global blacklists
+		Hashtable< uint64_t,PrefixTrie > peerBlacklists;
+	};
+	std::shared_ptr<const PathFilter> _pathFilter;
+
 	std::vector<InetAddress> explicitBind;
 
 	/*
@@ -172,7 +367,9 @@ public:
 	struct NetworkState
 	{
 		NetworkState() :
-			tap((EthernetTap *)0)
+			tap((EthernetTap *)0),
+			provisional(false),
+			neighborsSeeded(false)
 		{
 			// Real defaults are in network 'up' code in network event handler
 			settings.allowManaged = true;
@@ -185,9 +382,20 @@ public:
 		std::vector<InetAddress> managedIps;
 		std::list< SharedPtr<ManagedRoute> > managedRoutes;
 		NetworkSettings settings;
+		bool provisional; // Running on its cached config, see reconcileProvisionalNetworks()
+		bool neighborsSeeded; // Saved ARP entries restored (or found missing), see seedNeighbors()
 	};
 	std::map<uint64_t,NetworkState> _nets;
 	Mutex _nets_m;
+	std::atomic<unsigned int> _provisionalNetworks; // Number of provisional networks in _nets
+
+	// Static ARP entries added by seedNeighbors(), guarded by _nets_m, and when they are dropped
+	std::vector<InetAddress> _seededNeighbors;
+	std::atomic<int64_t> _neighborSeedExpiry;
+
+	// Outbound frames collected from the taps, only used by the service thread
+	std::vector<struct pbuf *> _txBatch;
+	std::vector<uint64_t> _txBatchNwids;
 
 	// Termination status information
 	ReasonForTermination _termReason;
@@ -208,14 +416,34 @@ public:
 
 	NodeServiceImpl(const char *hp,unsigned int port) :
 		_homePath((hp) ? hp : ".")
+		,_stateBackend((StateBackend *)0)
 		,_phy(this,false,true)
 		,_node((Node *)0)
 		,_updateAutoApply(false)
 		,_primaryPort(port)
 		,_udpPortPickerCounter(0)
+		,_peerCacheGeneration(0)
+		,_lastPeerCheck(0)
+		,_peerScanReady(false)
+		,_incomingPacketConcurrency(1)
+		,_incomingPacketsPending(0)
+		,_lastWakeupSample(0)
+		,_lastWakeupSampleTime(0)
+		,_startTime(0)
+		,_firstOnlineTime(0)
+		,_firstNetworkReadyTime(0)
+		,_stateLoadTime(0)
+		,_stateObjectsLoaded(0)
+#if defined(__linux__)
+		,_wireBatchSize(0)
+		,_udpOffload(false)
+#endif
+		,_pathFilter(new PathFilter())
 		,_lastDirectReceiveFromGlobal(0)
 		,_lastRestart(0)
 		,_nextBackgroundTaskDeadline(0)
+		,_provisionalNetworks(0)
+		,_neighborSeedExpiry(0)
 		,_termReason(ONE_STILL_RUNNING)
 		,_portMappingEnabled(true)
 #ifdef ZT_USE_MINIUPNPC
@@ -226,6 +454,15 @@ public:
 		_ports[0] = 0;
 		_ports[1] = 0;
 		_ports[2] = 0;
+#if defined(__linux__)
+		_portShardStopPipe[0] = -1;
+		_portShardStopPipe[1] = -1;
+#endif
+
+		for(unsigned int i=0;i<ZTS_MAX_WORKER_THREADS;++i) {
+			_workerStats[i].packets = 0;
+			_workerStats[i].bytes = 0;
+		}
 
 		allowNetworkCaching = true;
 		allowPeerCaching = true;
@@ -238,11 +475,14 @@ public:
 
 	virtual ~NodeServiceImpl()
 	{
-		_incomingPacketQueue.stop();
-		_incomingPacketThreadsLock.lock();
-		for(auto t=_incomingPacketThreads.begin();t!=_incomingPacketThreads.end();++t)
-			t->join();
-		_incomingPacketThreadsLock.unlock();
+		stopIncomingPacketThreads();
+
+#if defined(__linux__)
+		stopPortShards();
+		for(std::map<int64_t,NodeServiceSendBatch *>::iterator b(_wireSendBatches.begin());b!=_wireSendBatches.end();++b)
+			delete b->second;
+		_wireSendBatches.clear();
+#endif
 
 		_binder.closeAll(_phy);
 
@@ -260,27 +500,83 @@ public:
 
 	virtual ReasonForTermination run()
 	{
+		_startTime = OSUtils::now();
 		try {
+			// Make sure we can use the primary port, and hunt for one if configured to do so.
+			// Done first so giving up here leaves nothing to tear down.
+			const int portTrials = (_primaryPort == 0) ? 256 : 1; // if port is 0, pick random
+			for(int k=0;k<portTrials;++k) {
+				if (_primaryPort == 0) {
+					unsigned int randp = 0;
+					Utils::getSecureRandom(&randp,sizeof(randp));
+					_primaryPort = 20000 + (randp % 45500);
+				}
+				if (_trialBind(_primaryPort)) {
+					_ports[0] = _primaryPort;
+					break;
+				} else {
+					_primaryPort = 0;
+				}
+			}
+			if (_ports[0] == 0) {
+				Mutex::Lock _l(_termReason_m);
+				_termReason = ONE_UNRECOVERABLE_ERROR;
+				_fatalErrorMessage = "cannot bind to local control interface port";
+				return _termReason;
+			}
+
+			_stateBackend = StateBackend::create(stateBackend,_homePath,stateGetCallback,statePutCallback,stateCallbackArg);
+			if (!_stateBackend) {
+				Mutex::Lock _l(_termReason_m);
+				_termReason = ONE_UNRECOVERABLE_ERROR;
+				_fatalErrorMessage = "state backend could not be opened";
+				return _termReason;
+			}
+
 			{
+				// Only the file backend keeps the token on disk, others get a new one every start
+				const bool keepToken = _stateBackend->usesFiles();
 				const std::string authTokenPath(_homePath + ZT_PATH_SEPARATOR_S "authtoken.secret");
-				if (!OSUtils::readFile(authTokenPath.c_str(),_authToken)) {
+				if ((!keepToken)||(!OSUtils::readFile(authTokenPath.c_str(),_authToken))) {
 					unsigned char foo[24];
 					Utils::getSecureRandom(foo,sizeof(foo));
 					_authToken = "";
 					for(unsigned int i=0;i<sizeof(foo);++i)
 						_authToken.push_back("abcdefghijklmnopqrstuvwxyz0123456789"[(unsigned long)foo[i] % 36]);
-					if (!OSUtils::writeFile(authTokenPath.c_str(),_authToken)) {
-						Mutex::Lock _l(_termReason_m);
-						_termReason = ONE_UNRECOVERABLE_ERROR;
-						_fatalErrorMessage = "authtoken.secret could not be written";
-						return _termReason;
-					} else {
-						OSUtils::lockDownFile(authTokenPath.c_str(),false);
+					if (keepToken) {
+						if (!OSUtils::writeFile(authTokenPath.c_str(),_authToken)) {
+							delete _stateBackend;
+							_stateBackend = (StateBackend *)0;
+							Mutex::Lock _l(_termReason_m);
+							_termReason = ONE_UNRECOVERABLE_ERROR;
+							_fatalErrorMessage = "authtoken.secret could not be written";
+							return _termReason;
+						} else {
+							OSUtils::lockDownFile(authTokenPath.c_str(),false);
+						}
 					}
 				}
 				_authToken = _trimString(_authToken);
 			}
 
+			_stateCache.start(_stateBackend,stateFlushInterval);
+
+			{
+				// Load cached peers and network configs in one go before the node comes up, its
+				// lookups (including the many for peers never seen before) are then served from memory
+				const int64_t loadStart = OSUtils::now();
+				int loaded = 0;
+				if (allowPeerCaching)
+					loaded += std::max(_stateCache.preload(ZTS_STATE_OBJECT_PEER),0);
+				if (allowNetworkCaching)
+					loaded += std::max(_stateCache.preload(ZTS_STATE_OBJECT_NETWORK_CONFIG),0);
+				_stateLoadTime = (uint32_t)(OSUtils::now() - loadStart);
+				_stateObjectsLoaded = (uint32_t)loaded;
+			}
+
+			// Hints are only read by the node, so they must be in place before it exists
+			loadPathHints();
+
 			{
 				struct ZT_Node_Callbacks cb;
 				cb.version = 0;
@@ -294,29 +590,23 @@ public:
 				cb.pathLookupFunction = SnodePathLookupFunction;
 				_node = new Node(this,(void *)0,&cb,OSUtils::now());
 			}
-
-			// Make sure we can use the primary port, and hunt for one if configured to do so
-			const int portTrials = (_primaryPort == 0) ? 256 : 1; // if port is 0, pick random
-			for(int k=0;k<portTrials;++k) {
-				if (_primaryPort == 0) {
-					unsigned int randp = 0;
-					Utils::getSecureRandom(&randp,sizeof(randp));
-					_primaryPort = 20000 + (randp % 45500);
-				}
-				if (_trialBind(_primaryPort)) {
-					_ports[0] = _primaryPort;
-					break;
-				} else {
-					_primaryPort = 0;
-				}
+			{
+				Mutex::Lock _l(_peerScan_m);
+				_peerScanReady = true;
 			}
-			if (_ports[0] == 0) {
-				Mutex::Lock _l(_termReason_m);
-				_termReason = ONE_UNRECOVERABLE_ERROR;
-				_fatalErrorMessage = "cannot bind to local control interface port";
-				return _termReason;
+			{
+				// Published from here on, so no snapshot only ever means no service
+				Mutex::Lock _l(_nets_m);
+				publishNetworkSnapshot();
 			}
 
+#if defined(__linux__)
+			_wireBatchSize = (wireBatchSize > 1) ? wireBatchSize : 0;
+			_udpOffload = (allowUdpOffload != 0);
+			_wireSendDeferred = true;
+#endif
+			startIncomingPacketThreads();
+
 			// Attempt to bind to a secondary port chosen from our ZeroTier address.
 			// This exists because there are buggy NATs out there that fail if more
 			// than one device behind the same NAT tries to use the same internal
@@ -358,14 +648,21 @@ public:
 				}
 			}
 #endif
-			// Join existing networks in networks.d
+#if defined(__linux__)
+#ifdef ZTS_IO_URING
+			// The primary port always goes through shard sockets so io_uring can serve it
+			startPortShards((portShardCount > 1) ? portShardCount : 1);
+#else
+			if (portShardCount > 1)
+				startPortShards(portShardCount);
+#endif
+#endif
+			// Join networks with a cached config
 			if (allowNetworkCaching) {
-				std::vector<std::string> networksDotD(OSUtils::listDirectory((_homePath + ZT_PATH_SEPARATOR_S "networks.d").c_str()));
-				for(std::vector<std::string>::iterator f(networksDotD.begin());f!=networksDotD.end();++f) {
-					std::size_t dot = f->find_last_of('.');
-					if ((dot == 16)&&(f->substr(16) == ".conf"))
-						_node->join(Utils::hexStrToU64(f->substr(0,dot).c_str()),(void *)0,(void *)0);
-				}
+				std::vector<uint64_t> cachedNetworks;
+				_stateCache.list(ZTS_STATE_OBJECT_NETWORK_CONFIG,cachedNetworks);
+				for(std::vector<uint64_t>::iterator nwid(cachedNetworks.begin());nwid!=cachedNetworks.end();++nwid)
+					_node->join(*nwid,(void *)0,(void *)0);
 			}
 			// Main I/O loop
 			_nextBackgroundTaskDeadline = 0;
@@ -375,6 +672,7 @@ public:
 			int64_t lastBindRefresh = 0;
 			int64_t lastMultipathModeUpdate = 0;
 			int64_t lastCleanedPeersDb = 0;
+			int64_t lastProvisionalCheck = 0;
 			int64_t lastLocalInterfaceAddressCheck = (clockShouldBe - ZT_LOCAL_INTERFACE_CHECK_INTERVAL) + 15000; // do this in 15s to give portmapper time to configure and other things time to settle
 			for(;;) {
 				_run_m.lock();
@@ -402,7 +700,12 @@ public:
 					lastBindRefresh = now;
 					unsigned int p[3];
 					unsigned int pc = 0;
+					// The shards already own the primary port on every interface
+#if defined(__linux__)
+					for(int i=(_portShards.empty() ? 0 : 1);i<3;++i) {
+#else
 					for(int i=0;i<3;++i) {
+#endif
 						if (_ports[i])
 							p[pc++] = _ports[i];
 					}
@@ -416,6 +719,18 @@ public:
 
 				//
 				generateEventMsgs();
+				if (((now - _lastPeerCheck) >= ZTS_PEER_CHECK_INTERVAL)&&(_isEventEnabled(ZTS_EVENT_MASK_PEER))) {
+					_lastPeerCheck = now;
+					scanPeers();
+				}
+				if ((_provisionalNetworks)&&((now - lastProvisionalCheck) >= ZTS_PROVISIONAL_CHECK_INTERVAL)) {
+					lastProvisionalCheck = now;
+					reconcileProvisionalNetworks(now);
+				}
+				if ((_neighborSeedExpiry)&&(now >= _neighborSeedExpiry)) {
+					Mutex::Lock _l(_nets_m);
+					releaseNeighborSeeds();
+				}
 
 				// Run background task processor in core if it's time to do so
 				int64_t dl = _nextBackgroundTaskDeadline;
@@ -463,17 +778,31 @@ public:
 					std::vector<InetAddress> boundAddrs(_binder.allBoundLocalInterfaceAddresses());
 					for(std::vector<InetAddress>::const_iterator i(boundAddrs.begin());i!=boundAddrs.end();++i)
 						_node->addLocalInterfaceAddress(reinterpret_cast<const struct sockaddr_storage *>(&(*i)));
+#if defined(__linux__)
+					// Shards are wildcard binds, so Binder knows nothing of the primary port
+					if (!_portShards.empty()) {
+						std::vector<InetAddress> shardAddrs;
+						_portShardLocalAddresses(shardAddrs);
+						for(std::vector<InetAddress>::const_iterator i(shardAddrs.begin());i!=shardAddrs.end();++i)
+							_node->addLocalInterfaceAddress(reinterpret_cast<const struct sockaddr_storage *>(&(*i)));
+					}
+#endif
 				}
 
-				// Clean peers.d periodically
+				// Clean cached peers periodically
 				if ((now - lastCleanedPeersDb) >= 3600000) {
 					lastCleanedPeersDb = now;
-					OSUtils::cleanDirectory((_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(),now - 2592000000LL); // delete older than 30 days
+					_stateCache.expirePeers(now - 2592000000LL); // delete older than 30 days
 				}
 
 				const unsigned long delay = (dl > now) ? (unsigned long)(dl - now) : 100;
 				clockShouldBe = now + (uint64_t)delay;
+				flushTapQueues();
+				flushWireSends();
 				_phy.poll(delay);
+				_threadWakeups++;
+				flushTapQueues();
+				flushWireSends();
 			}
 		} catch (std::exception &e) {
 			Mutex::Lock _l(_termReason_m);
@@ -485,16 +814,41 @@ public:
 			_fatalErrorMessage = "unexpected exception in main thread: unknown exception";
 		}
 
+		// Workers use the node and taps, so they must be gone first
+		stopIncomingPacketThreads();
+#if defined(__linux__)
+		stopPortShards();
+#endif
+		{
+			// No more on-demand scans, the node is about to go
+			Mutex::Lock _l(_peerScan_m);
+			_peerScanReady = false;
+			_setPeerSnapshot(std::shared_ptr<const PeerSnapshot>());
+		}
+
+		// What was learned about reaching peers and hosts speeds up the next start
+		if (_node)
+			savePathHints();
 		{
 			Mutex::Lock _l(_nets_m);
+			for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n)
+				saveNeighbors(n->first,n->second);
+			releaseNeighborSeeds();
 			for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n)
 				delete n->second.tap;
 			_nets.clear();
+			_provisionalNetworks = 0;
 		}
+		_setNetworkSnapshot(std::shared_ptr<const NetworkSnapshot>());
 
 		delete _node;
 		_node = (Node *)0;
 
+		// Write whatever the node left pending
+		_stateCache.stop();
+		delete _stateBackend;
+		_stateBackend = (StateBackend *)0;
+
 		return _termReason;
 	}
 
@@ -632,221 +986,1289 @@ public:
 	{
 		if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
 			_lastDirectReceiveFromGlobal = OSUtils::now();
-		const ZT_ResultCode rc = _node->processWirePacket(
-			(void *)0,
-			OSUtils::now(),
-			reinterpret_cast<int64_t>(sock),
-			reinterpret_cast<const struct sockaddr_storage *>(from), // Phy<> uses sockaddr_storage, so it'll always be that big
-			data,
-			len,
-			&_nextBackgroundTaskDeadline);
-		if (ZT_ResultCode_isFatal(rc)) {
-			char tmp[256];
-			OSUtils::ztsnprintf(tmp,sizeof(tmp),"fatal error code from processWirePacket: %d",(int)rc);
-			Mutex::Lock _l(_termReason_m);
-			_termReason = ONE_UNRECOVERABLE_ERROR;
-			_fatalErrorMessage = tmp;
-			this->terminate();
-		}
-	}
-
-	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
-	inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from) {}
-	void phyOnTcpClose(PhySocket *sock,void **uptr) {}
-	void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
-	inline void phyOnTcpWritable(PhySocket *sock,void **uptr) {}
-	inline void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
-	inline void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
-	inline void phyOnUnixClose(PhySocket *sock,void **uptr) {}
-	inline void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
-	inline void phyOnUnixWritable(PhySocket *sock,void **uptr) {}
-
-	inline int nodeVirtualNetworkConfigFunction(uint64_t nwid,void **nuptr,enum ZT_VirtualNetworkConfigOperation op,const ZT_VirtualNetworkConfig *nwc)
-	{
-		Mutex::Lock _l(_nets_m);
-		NetworkState &n = _nets[nwid];
+		if (len > ZT_MAX_MTU)
+			return;
 
-		switch(op) {
+		NodeServiceIncomingPacket *pkt;
+		_incomingPacketMemoryPoolLock.lock();
+		if (_incomingPacketMemoryPool.empty()) {
+			pkt = new NodeServiceIncomingPacket;
+		} else {
+			pkt = _incomingPacketMemoryPool.back();
+			_incomingPacketMemoryPool.pop_back();
+		}
+		_incomingPacketMemoryPoolLock.unlock();
 
-			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_UP:
-				if (!n.tap) {
-					char friendlyName[128];
-					OSUtils::ztsnprintf(friendlyName,sizeof(friendlyName),"ZeroTier One [%.16llx]",nwid);
+		pkt->now = OSUtils::now();
+		pkt->sock = reinterpret_cast<int64_t>(sock);
+		memcpy(&(pkt->from),from,sizeof(struct sockaddr_storage)); // Phy<> uses sockaddr_storage, so it'll always be that big
+		pkt->size = (unsigned int)len;
+		memcpy(pkt->data,data,len);
 
-					n.tap = new EthernetTap(
-						_homePath.c_str(),
-						MAC(nwc->mac),
-						nwc->mtu,
-						(unsigned int)ZT_IF_METRIC,
-						nwid,
-						friendlyName,
-						StapFrameHandler,
-						(void *)this);
-					*nuptr = (void *)&n;
-				}
-				// After setting up tap, fall through to CONFIG_UPDATE since we also want to do this...
+		++_incomingPacketsPending;
+		_incomingPacketQueue.postLimit(pkt,256 * _incomingPacketConcurrency);
 
-			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_CONFIG_UPDATE:
-				memcpy(&(n.config),nwc,sizeof(ZT_VirtualNetworkConfig));
-				if (n.tap) { // sanity check
-					syncManagedStuff(n);
-					n.tap->setMtu(nwc->mtu);
-				} else {
-					_nets.erase(nwid);
-					return -999; // tap init failed
-				}
-				break;
+#if defined(__linux__)
+		// Phy<> reads one datagram per call, pick up whatever else is waiting in bulk
+		if (_wireBatchSize)
+			drainUdpSocket(sock);
+#endif
+	}
 
-			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DOWN:
-			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DESTROY:
-				if (n.tap) { // sanity check
-					*nuptr = (void *)0;
-					delete n.tap;
-					_nets.erase(nwid);
-					if (allowNetworkCaching) {
-						if (op == ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DESTROY) {
-							char nlcpath[256];
-							OSUtils::ztsnprintf(nlcpath,sizeof(nlcpath),"%s" ZT_PATH_SEPARATOR_S "networks.d" ZT_PATH_SEPARATOR_S "%.16llx.local.conf",_homePath.c_str(),nwid);
-							OSUtils::rm(nlcpath);
-						}
+#if defined(__linux__)
+	/**
+	 * Read all datagrams waiting on a UDP socket with recvmmsg() and queue them for the workers
+	 */
+	void drainUdpSocket(PhySocket *sock)
+	{
+		const int fd = (int)_phy.getDescriptor(sock);
+		const unsigned int batch = _wireBatchSize;
+		for(unsigned int total=0;total<1024;) {
+			{
+				Mutex::Lock _l(_incomingPacketMemoryPoolLock);
+				for(unsigned int i=0;i<batch;++i) {
+					if (_incomingPacketMemoryPool.empty()) {
+						_wireRecvPkts[i] = new NodeServiceIncomingPacket;
+					} else {
+						_wireRecvPkts[i] = _incomingPacketMemoryPool.back();
+						_incomingPacketMemoryPool.pop_back();
 					}
-				} else {
-					_nets.erase(nwid);
 				}
+			}
+			for(unsigned int i=0;i<batch;++i) {
+				_wireRecvIov[i].iov_base = _wireRecvPkts[i]->data;
+				_wireRecvIov[i].iov_len = sizeof(_wireRecvPkts[i]->data);
+				memset(&(_wireRecvMsgs[i]),0,sizeof(struct mmsghdr));
+				_wireRecvMsgs[i].msg_hdr.msg_name = &(_wireRecvPkts[i]->from);
+				_wireRecvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+				_wireRecvMsgs[i].msg_hdr.msg_iov = &(_wireRecvIov[i]);
+				_wireRecvMsgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			const int n = ::recvmmsg(fd,_wireRecvMsgs,batch,MSG_DONTWAIT,(struct timespec *)0);
+			const int64_t now = OSUtils::now();
+			int posted = 0;
+			for(int i=0;i<n;++i) {
+				NodeServiceIncomingPacket *pkt = _wireRecvPkts[i];
+				if ((_wireRecvMsgs[i].msg_len == 0)||(_wireRecvMsgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+					continue;
+				if ((_wireRecvMsgs[i].msg_len >= 16)&&(reinterpret_cast<const InetAddress *>(&(pkt->from))->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
+					_lastDirectReceiveFromGlobal = now;
+				pkt->now = now;
+				pkt->sock = reinterpret_cast<int64_t>(sock);
+				pkt->size = (unsigned int)_wireRecvMsgs[i].msg_len;
+				++_incomingPacketsPending;
+				_incomingPacketQueue.postLimit(pkt,256 * _incomingPacketConcurrency);
+				_wireRecvPkts[i] = (NodeServiceIncomingPacket *)0;
+				++posted;
+			}
+			{
+				Mutex::Lock _l(_incomingPacketMemoryPoolLock);
+				for(unsigned int i=0;i<batch;++i) {
+					if (_wireRecvPkts[i])
+						_incomingPacketMemoryPool.push_back(_wireRecvPkts[i]);
+				}
+			}
+			if (n < (int)batch)
 				break;
+			total += (unsigned int)n;
 		}
-		return 0;
 	}
 
-	inline void nodeEventCallback(enum ZT_Event event,const void *metaData)
+	/**
+	 * Add a datagram to the socket's send batch, sending the batch if it is full
+	 *
+	 * _wireSend_m only covers copying the datagram in. A full batch is swapped
+	 * for this thread's spare and sent after the lock is released, so threads
+	 * never wait on each other's system calls.
+	 */
+	inline bool queueWireSend(int64_t localSocket,int fd,const struct sockaddr_storage *addr,const void *data,unsigned int len)
 	{
-		// Feed node events into lock-free queue for later dequeuing by the callback thread
-		switch(event) {
-			case ZT_EVENT_UP: {
-				_enqueueEvent(ZTS_EVENT_NODE_UP, NULL);
-			}	break;
-			case ZT_EVENT_ONLINE: {
-				struct zts_node_details *nd = new zts_node_details;
-				nd->address = _node->address();
-				_enqueueEvent(ZTS_EVENT_NODE_ONLINE, (void*)nd);
-			}	break;
-			case ZT_EVENT_OFFLINE: {
-				struct zts_node_details *nd = new zts_node_details;
-				nd->address = _node->address();
-				_enqueueEvent(ZTS_EVENT_NODE_OFFLINE, (void*)nd);
-			}	break;
-			case ZT_EVENT_DOWN: {
-				struct zts_node_details *nd = new zts_node_details;
-				nd->address = _node->address();
-				_enqueueEvent(ZTS_EVENT_NODE_DOWN, (void*)nd);
-			}	break;
-			case ZT_EVENT_FATAL_ERROR_IDENTITY_COLLISION: {
-				Mutex::Lock _l(_termReason_m);
-				_termReason = ONE_IDENTITY_COLLISION;
-				_fatalErrorMessage = "identity/address collision";
-				this->terminate();
-			}	break;
-
-			case ZT_EVENT_TRACE: {
-				if (metaData) {
-					::fprintf(stderr,"%s" ZT_EOL_S,(const char *)metaData);
-					::fflush(stderr);
-				}
-			}	break;
-
-			default:
-				break;
+		if (!_wireSendSpare)
+			_wireSendSpare.reset(new NodeServiceSendBatch);
+		NodeServiceSendBatch *full = (NodeServiceSendBatch *)0;
+		const bool direct = (len > ZTS_WIRE_BATCH_SLOT_SIZE);
+		{
+			Mutex::Lock _l(_wireSend_m);
+			NodeServiceSendBatch *&b = _wireSendBatches[localSocket];
+			if (!b) {
+				b = new NodeServiceSendBatch;
+				b->count = 0;
+			}
+			b->fd = fd;
+			if (direct) {
+				// Send what is queued first and then this one directly
+				if (b->count)
+					full = _takeWireBatch(b);
+			} else {
+				const unsigned int i = b->count++;
+				memcpy(b->data[i],data,len);
+				memcpy(&(b->addrs[i]),addr,sizeof(struct sockaddr_storage));
+				b->iov[i].iov_base = b->data[i];
+				b->iov[i].iov_len = len;
+				memset(&(b->msgs[i]),0,sizeof(struct mmsghdr));
+				b->msgs[i].msg_hdr.msg_name = &(b->addrs[i]);
+				b->msgs[i].msg_hdr.msg_namelen = (addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+				b->msgs[i].msg_hdr.msg_iov = &(b->iov[i]);
+				b->msgs[i].msg_hdr.msg_iovlen = 1;
+				if (b->count >= _wireBatchSize)
+					full = _takeWireBatch(b);
+			}
 		}
+		if (full)
+			_sendTakenWireBatch(full);
+		if (direct)
+			return (::sendto(fd,data,len,0,(const struct sockaddr *)addr,(addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (ssize_t)len);
+		return true;
+	}
+
+	/**
+	 * Replace a socket's batch with this thread's empty spare (caller must hold _wireSend_m)
+	 *
+	 * @return The batch that was replaced, to be sent with _sendTakenWireBatch()
+	 */
+	inline NodeServiceSendBatch *_takeWireBatch(NodeServiceSendBatch *&b)
+	{
+		NodeServiceSendBatch *full = b;
+		b = _wireSendSpare.release();
+		b->fd = full->fd;
+		b->count = 0;
+		return full;
 	}
 
-	inline struct zts_network_details *prepare_network_details_msg(uint64_t nwid)
+	/**
+	 * Send a batch taken with _takeWireBatch() and keep it as this thread's spare
+	 */
+	inline void _sendTakenWireBatch(NodeServiceSendBatch *full)
 	{
-		struct zts_network_details *nd = new zts_network_details;
-		nd->nwid = nwid;
-		return nd;
+		_sendWireBatch(full);
+		_wireSendSpare.reset(full);
 	}
 
-	inline void generateEventMsgs()
+	// Only called on batches no other thread can reach (see _takeWireBatch())
+	inline void _sendWireBatch(NodeServiceSendBatch *b)
 	{
-		// Force the ordering of callback messages, these messages are
-		// only useful if the node and stack are both up and running
-		if (!_node->online() || !_lwip_is_up()) {
+		if ((_udpOffload)&&(b->count > 1)&&(_sendWireBatchSegmented(b))) {
+			b->count = 0;
 			return;
 		}
-		// Generate messages to be dequeued by the callback message thread
-		Mutex::Lock _l(_nets_m);
-		for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
-			int mostRecentStatus = n->second.config.status;
-			VirtualTap *tap = n->second.tap;
-			uint64_t nwid = n->first;
-			if (n->second.tap->_networkStatus == mostRecentStatus) {
-				continue; // No state change
+		_sendWireMsgs(b->fd,b->msgs,b->count);
+		b->count = 0;
+	}
+
+	inline void _sendWireMsgs(int fd,struct mmsghdr *msgs,unsigned int count)
+	{
+		unsigned int sent = 0;
+		while (sent < count) {
+			const int n = ::sendmmsg(fd,&(msgs[sent]),count - sent,0);
+			if (n <= 0)
+				break; // UDP is best effort, drop the rest just like a failed sendto()
+			sent += (unsigned int)n;
+		}
+	}
+
+	/**
+	 * Send a batch with runs of same-size datagrams to the same destination merged
+	 * into single UDP_SEGMENT sends
+	 *
+	 * @return False if nothing was merged and the batch should be sent as is
+	 */
+	bool _sendWireBatchSegmented(NodeServiceSendBatch *b)
+	{
+		unsigned int m = 0;
+		bool merged = false;
+		for(unsigned int i=0;i<b->count;) {
+			const size_t seg = b->iov[i].iov_len;
+			const InetAddress *dest = reinterpret_cast<const InetAddress *>(&(b->addrs[i]));
+			size_t bytes = seg;
+			unsigned int j = i + 1;
+			// All segments but the last must be exactly seg bytes
+			while ((j < b->count)&&((j - i) < ZTS_GSO_MAX_SEGMENTS)&&(b->iov[j].iov_len <= seg)&&((bytes + b->iov[j].iov_len) <= ZTS_GSO_MAX_BYTES)&&(*reinterpret_cast<const InetAddress *>(&(b->addrs[j])) == *dest)) {
+				bytes += b->iov[j].iov_len;
+				if (b->iov[j++].iov_len < seg)
+					break;
 			}
-			switch (mostRecentStatus) {
-				case ZT_NETWORK_STATUS_NOT_FOUND:
-					_enqueueEvent(ZTS_EVENT_NETWORK_NOT_FOUND, (void*)prepare_network_details_msg(nwid));
+			b->gsoFirst[m] = i;
+			b->gsoMsgs[m] = b->msgs[i];
+			if ((j - i) > 1) {
+				b->gsoMsgs[m].msg_hdr.msg_iovlen = j - i;
+				b->gsoMsgs[m].msg_hdr.msg_control = b->gsoCtrl[m];
+				b->gsoMsgs[m].msg_hdr.msg_controllen = sizeof(b->gsoCtrl[m]);
+				struct cmsghdr *cm = CMSG_FIRSTHDR(&(b->gsoMsgs[m].msg_hdr));
+				cm->cmsg_level = IPPROTO_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				const uint16_t segSize = (uint16_t)seg;
+				memcpy(CMSG_DATA(cm),&segSize,sizeof(segSize));
+				merged = true;
+			}
+			++m;
+			i = j;
+		}
+		if (!merged)
+			return false;
+		b->gsoFirst[m] = b->count;
+		unsigned int sent = 0;
+		while (sent < m) {
+			const int n = ::sendmmsg(b->fd,&(b->gsoMsgs[sent]),m - sent,0);
+			if (n > 0) {
+				sent += (unsigned int)n;
+				continue;
+			}
+			if ((errno == EIO)||(errno == EINVAL)||(errno == ENOPROTOOPT)) {
+				// Kernel or NIC can't do it, stop trying and send the rest one by one
+				_udpOffload = false;
+				_sendWireMsgs(b->fd,&(b->msgs[b->gsoFirst[sent]]),b->count - b->gsoFirst[sent]);
+			}
+			break;
+		}
+		return true;
+	}
+
+	/**
+	 * @param shard If not NULL, set to the shard owning the socket
+	 * @return Descriptor of a shard socket or -1 if localSocket is not one of ours
+	 */
+	inline int _portShardFd(int64_t localSocket,NodeServicePortShard **shard = (NodeServicePortShard **)0) const
+	{
+		for(std::vector<NodeServicePortShard *>::const_iterator s(_portShards.begin());s!=_portShards.end();++s) {
+			for(int f=0;f<2;++f) {
+				if (((*s)->fd[f] >= 0)&&(reinterpret_cast<int64_t>(&((*s)->fd[f])) == localSocket)) {
+					if (shard)
+						*shard = *s;
+					return (*s)->fd[f];
+				}
+			}
+		}
+		return -1;
+	}
+
+	int _openPortShardSocket(int family,unsigned int port)
+	{
+		const int fd = ::socket(family,SOCK_DGRAM,0);
+		if (fd < 0)
+			return -1;
+		int f = 1;
+		::setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,(void *)&f,sizeof(f));
+		if (family == AF_INET6) {
+			f = 1; ::setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,(void *)&f,sizeof(f));
+		} else {
+			f = IP_PMTUDISC_DONT; ::setsockopt(fd,IPPROTO_IP,IP_MTU_DISCOVER,(void *)&f,sizeof(f));
+		}
+		f = 1048576; ::setsockopt(fd,SOL_SOCKET,SO_RCVBUF,(const char *)&f,sizeof(f));
+		f = 1048576; ::setsockopt(fd,SOL_SOCKET,SO_SNDBUF,(const char *)&f,sizeof(f));
+		::fcntl(fd,F_SETFL,::fcntl(fd,F_GETFL) | O_NONBLOCK);
+		if (_udpOffload) {
+			f = 1; ::setsockopt(fd,IPPROTO_UDP,UDP_GRO,(void *)&f,sizeof(f));
+		}
+
+		struct sockaddr_storage ss;
+		memset(&ss,0,sizeof(ss));
+		socklen_t slen;
+		if (family == AF_INET6) {
+			reinterpret_cast<struct sockaddr_in6 *>(&ss)->sin6_family = AF_INET6;
+			reinterpret_cast<struct sockaddr_in6 *>(&ss)->sin6_port = Utils::hton((uint16_t)port);
+			slen = sizeof(struct sockaddr_in6);
+		} else {
+			reinterpret_cast<struct sockaddr_in *>(&ss)->sin_family = AF_INET;
+			reinterpret_cast<struct sockaddr_in *>(&ss)->sin_port = Utils::hton((uint16_t)port);
+			slen = sizeof(struct sockaddr_in);
+		}
+		if (::bind(fd,(const struct sockaddr *)&ss,slen) != 0) {
+			::close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	/**
+	 * Get the local interface addresses the shards receive on, with the primary port
+	 *
+	 * Interfaces are picked the way Binder picks them, but enumerated here as
+	 * Binder may bind nothing at all (e.g. when the secondary port is disabled).
+	 */
+	void _portShardLocalAddresses(std::vector<InetAddress> &addrs)
+	{
+		if (!explicitBind.empty()) {
+			for(std::vector<InetAddress>::const_iterator i(explicitBind.begin());i!=explicitBind.end();++i) {
+				InetAddress a(*i);
+				a.setPort(_ports[0]);
+				addrs.push_back(a);
+			}
+			return;
+		}
+		struct ifaddrs *ifatbl = (struct ifaddrs *)0;
+		if ((::getifaddrs(&ifatbl) != 0)||(!ifatbl))
+			return;
+		for(struct ifaddrs *ifa=ifatbl;ifa;ifa=ifa->ifa_next) {
+			if ((!ifa->ifa_addr)||(!ifa->ifa_name)||(!(ifa->ifa_flags & IFF_UP)))
+				continue;
+			if ((ifa->ifa_addr->sa_family != AF_INET)&&(ifa->ifa_addr->sa_family != AF_INET6))
+				continue;
+			InetAddress a(ifa->ifa_addr);
+			switch(a.ipScope()) {
+				case InetAddress::IP_SCOPE_PSEUDOPRIVATE:
+				case InetAddress::IP_SCOPE_GLOBAL:
+				case InetAddress::IP_SCOPE_SHARED:
+				case InetAddress::IP_SCOPE_PRIVATE:
+					if (shouldBindInterface(ifa->ifa_name,a)) {
+						a.setPort(_ports[0]);
+						if (std::find(addrs.begin(),addrs.end(),a) == addrs.end())
+							addrs.push_back(a);
+					}
 					break;
-				case ZT_NETWORK_STATUS_CLIENT_TOO_OLD:
-					_enqueueEvent(ZTS_EVENT_NETWORK_CLIENT_TOO_OLD, (void*)prepare_network_details_msg(nwid));
+				default:
 					break;
+			}
+		}
+		::freeifaddrs(ifatbl);
+	}
+
+	/**
+	 * Open count SO_REUSEPORT sockets on the primary port and start a thread for each
+	 */
+	void startPortShards(unsigned int count)
+	{
+		if (::pipe(_portShardStopPipe) != 0)
+			return;
+		for(unsigned int k=0;k<count;++k) {
+			NodeServicePortShard *s = new NodeServicePortShard;
+			s->fd[0] = _openPortShardSocket(AF_INET,_ports[0]);
+			s->fd[1] = _openPortShardSocket(AF_INET6,_ports[0]);
+			s->stats.packets = 0;
+			s->stats.bytes = 0;
+			if ((s->fd[0] < 0)&&(s->fd[1] < 0)) {
+				delete s;
+				break;
+			}
+			// GRO hands us up to 64KiB at a time, so use fewer but larger slots
+			s->rxSlots = (_udpOffload) ? ZTS_GRO_BATCH_SIZE : ZTS_WIRE_BATCH_SIZE_MAX;
+			s->rxSlotSize = (_udpOffload) ? ZTS_GRO_SLOT_SIZE : ZT_MAX_MTU;
+			s->rxbuf = new uint8_t[s->rxSlots * s->rxSlotSize];
+#ifdef ZTS_IO_URING
+			s->service = this;
+			s->ring = new UdpRing();
+			if (!s->ring->init(s->fd,2,_portShardStopPipe[0],(_udpOffload) ? 64 : 512,s->rxSlotSize)) {
+				// No io_uring here (old kernel, seccomp, ...), this shard uses poll()
+				delete s->ring;
+				s->ring = (UdpRing *)0;
+			}
+#endif
+			_portShards.push_back(s);
+		}
+		if (_portShards.size() != count) {
+			// Could not open all of them, fall back to a plain Binder socket
+			stopPortShards();
+			return;
+		}
+		for(std::vector<NodeServicePortShard *>::iterator s(_portShards.begin());s!=_portShards.end();++s) {
+			NodeServicePortShard *shard = *s;
+			shard->thread = std::thread([this,shard]() { this->portShardThreadMain(shard); });
+		}
+	}
+
+	/**
+	 * Stop all shard threads and close their sockets (safe to call more than once)
+	 */
+	void stopPortShards()
+	{
+		if (_portShardStopPipe[1] >= 0)
+			::write(_portShardStopPipe[1],"\0",1);
+		for(std::vector<NodeServicePortShard *>::iterator s(_portShards.begin());s!=_portShards.end();++s) {
+			if ((*s)->thread.joinable())
+				(*s)->thread.join();
+		}
+		{
+			// Drop any batches still pointing at shard sockets
+			Mutex::Lock _l(_wireSend_m);
+			for(std::map<int64_t,NodeServiceSendBatch *>::iterator b(_wireSendBatches.begin());b!=_wireSendBatches.end();) {
+				if (_portShardFd(b->first) >= 0) {
+					delete b->second;
+					_wireSendBatches.erase(b++);
+				} else ++b;
+			}
+		}
+		for(std::vector<NodeServicePortShard *>::iterator s(_portShards.begin());s!=_portShards.end();++s) {
+			for(int f=0;f<2;++f) {
+				if ((*s)->fd[f] >= 0)
+					::close((*s)->fd[f]);
+			}
+			delete [] (*s)->rxbuf;
+#ifdef ZTS_IO_URING
+			delete (*s)->ring;
+#endif
+			delete *s;
+		}
+		_portShards.clear();
+		for(int i=0;i<2;++i) {
+			if (_portShardStopPipe[i] >= 0) {
+				::close(_portShardStopPipe[i]);
+				_portShardStopPipe[i] = -1;
+			}
+		}
+	}
+
+	void portShardThreadMain(NodeServicePortShard *s)
+	{
+		_wireSendDeferred = true;
+		_threadCount++;
+		runPortShard(s);
+		_threadCount--;
+	}
+
+	void runPortShard(NodeServicePortShard *s)
+	{
+#ifdef ZTS_IO_URING
+		if ((s->ring)&&(s->ring->run(SportShardDatagram,SportShardBatchDone,s)))
+			return;
+		// Kernel can't do multishot receives, carry on with poll(). The ring
+		// now refuses sends so they go out directly, it is freed with the shard.
+#endif
+		struct pollfd pfds[3];
+		int pfdSocket[2];
+		nfds_t n = 0;
+		for(int f=0;f<2;++f) {
+			if (s->fd[f] >= 0) {
+				pfdSocket[n] = f;
+				pfds[n].fd = s->fd[f];
+				pfds[n].events = POLLIN;
+				++n;
+			}
+		}
+		const nfds_t stop = n;
+		pfds[stop].fd = _portShardStopPipe[0];
+		pfds[stop].events = POLLIN;
+		while (_run) {
+			for(nfds_t i=0;i<=stop;++i)
+				pfds[i].revents = 0;
+			if (::poll(pfds,stop + 1,-1) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			_threadWakeups++;
+			if (pfds[stop].revents)
+				break;
+			for(nfds_t i=0;i<stop;++i) {
+				if ((pfds[i].revents & POLLIN)&&(!readPortShard(s,pfdSocket[i])))
+					return;
+			}
+			flushTapRxBatches();
+			flushWireSends();
+		}
+	}
+
+	/**
+	 * Read and process everything waiting on one shard socket
+	 *
+	 * @return False if the node reported a fatal error
+	 */
+	bool readPortShard(NodeServicePortShard *s,int f)
+	{
+		const int64_t localSocket = reinterpret_cast<int64_t>(&(s->fd[f]));
+		for(unsigned int total=0;total<1024;) {
+			for(unsigned int i=0;i<s->rxSlots;++i) {
+				s->iov[i].iov_base = s->rxbuf + (i * s->rxSlotSize);
+				s->iov[i].iov_len = s->rxSlotSize;
+				memset(&(s->msgs[i]),0,sizeof(struct mmsghdr));
+				s->msgs[i].msg_hdr.msg_name = &(s->from[i]);
+				s->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+				s->msgs[i].msg_hdr.msg_iov = &(s->iov[i]);
+				s->msgs[i].msg_hdr.msg_iovlen = 1;
+				s->msgs[i].msg_hdr.msg_control = s->ctrl[i];
+				s->msgs[i].msg_hdr.msg_controllen = sizeof(s->ctrl[i]);
+			}
+			const int n = ::recvmmsg(s->fd[f],s->msgs,s->rxSlots,MSG_DONTWAIT,(struct timespec *)0);
+			const int64_t now = OSUtils::now();
+			for(int i=0;i<n;++i) {
+				const unsigned int len = s->msgs[i].msg_len;
+				if ((len == 0)||(s->msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+					continue;
+				// A GRO coalesced datagram carries the size of the original datagrams
+				unsigned int seg = len;
+				for(struct cmsghdr *cm=CMSG_FIRSTHDR(&(s->msgs[i].msg_hdr));cm;cm=CMSG_NXTHDR(&(s->msgs[i].msg_hdr),cm)) {
+					if ((cm->cmsg_level == IPPROTO_UDP)&&(cm->cmsg_type == UDP_GRO)) {
+						int gso = 0;
+						memcpy(&gso,CMSG_DATA(cm),sizeof(gso));
+						if (gso > 0)
+							seg = (unsigned int)gso;
+					}
+				}
+				if (!processPortShardDatagram(s,localSocket,&(s->from[i]),reinterpret_cast<const uint8_t *>(s->iov[i].iov_base),len,seg,now))
+					return false;
+			}
+			if (n < (int)s->rxSlots)
+				break;
+			total += (unsigned int)n;
+		}
+		return true;
+	}
+
+	/**
+	 * Hand one received (possibly GRO coalesced) datagram to the node
+	 *
+	 * @param seg Size of the original datagrams if several were coalesced, else len
+	 * @return False if the node reported a fatal error
+	 */
+	bool processPortShardDatagram(NodeServicePortShard *s,int64_t localSocket,const struct sockaddr_storage *from,const uint8_t *data,unsigned int len,unsigned int seg,int64_t now)
+	{
+		if ((len >= 16)&&(reinterpret_cast<const InetAddress *>(from)->ipScope() == InetAddress::IP_SCOPE_GLOBAL))
+			_lastDirectReceiveFromGlobal = now;
+		for(unsigned int off=0;off<len;off+=seg) {
+			const unsigned int plen = ((len - off) < seg) ? (len - off) : seg;
+			const ZT_ResultCode rc = _node->processWirePacket(
+				(void *)0,
+				now,
+				localSocket,
+				from,
+				data + off,
+				plen,
+				&_nextBackgroundTaskDeadline);
+			s->stats.packets.fetch_add(1,std::memory_order_relaxed);
+			s->stats.bytes.fetch_add(plen,std::memory_order_relaxed);
+			if (ZT_ResultCode_isFatal(rc)) {
+				char tmp[256];
+				OSUtils::ztsnprintf(tmp,sizeof(tmp),"fatal error code from processWirePacket: %d",(int)rc);
+				Mutex::Lock _l(_termReason_m);
+				_termReason = ONE_UNRECOVERABLE_ERROR;
+				_fatalErrorMessage = tmp;
+				this->terminate();
+				return false;
+			}
+		}
+		return true;
+	}
+
+#ifdef ZTS_IO_URING
+	inline bool portShardDatagram(NodeServicePortShard *s,int fd,const struct sockaddr_storage *from,const void *data,unsigned int len,unsigned int seg)
+	{
+		const int f = (s->fd[0] == fd) ? 0 : 1;
+		return processPortShardDatagram(s,reinterpret_cast<int64_t>(&(s->fd[f])),from,reinterpret_cast<const uint8_t *>(data),len,seg,OSUtils::now());
+	}
+
+	inline void portShardBatchDone()
+	{
+		_threadWakeups++;
+		flushTapRxBatches();
+		flushWireSends();
+	}
+#endif
+#endif
+
+	/**
+	 * Send all coalesced wire packets (no-op unless batched physical I/O is enabled)
+	 */
+	inline void flushWireSends()
+	{
+#ifdef ZTS_IO_URING
+		for(std::vector<NodeServicePortShard *>::iterator s(_portShards.begin());s!=_portShards.end();++s) {
+			if ((*s)->ring)
+				(*s)->ring->flush();
+		}
+#endif
+#if defined(__linux__)
+		if (!_wireBatchSize)
+			return;
+		if (!_wireSendSpare)
+			_wireSendSpare.reset(new NodeServiceSendBatch);
+		// One batch at a time, each is sent with _wireSend_m released
+		int64_t last = 0;
+		bool started = false;
+		for(;;) {
+			NodeServiceSendBatch *full = (NodeServiceSendBatch *)0;
+			{
+				Mutex::Lock _l(_wireSend_m);
+				std::map<int64_t,NodeServiceSendBatch *>::iterator b((started) ? _wireSendBatches.upper_bound(last) : _wireSendBatches.begin());
+				while (b!=_wireSendBatches.end()) {
+					if ((_portShardFd(b->first) < 0)&&(!_binder.isUdpSocketValid((PhySocket *)((uintptr_t)b->first)))) {
+						// Socket went away with a binder refresh
+						delete b->second;
+						_wireSendBatches.erase(b++);
+						continue;
+					}
+					if (b->second->count) {
+						last = b->first;
+						started = true;
+						full = _takeWireBatch(b->second);
+						break;
+					}
+					++b;
+				}
+			}
+			if (!full)
+				break;
+			_sendTakenWireBatch(full);
+		}
+#endif
+	}
+
+	/**
+	 * Start the threads that decrypt and process incoming wire packets
+	 */
+	void startIncomingPacketThreads()
+	{
+		_incomingPacketConcurrency = incomingPacketConcurrency;
+		if (!_incomingPacketConcurrency)
+			_incomingPacketConcurrency = std::max((unsigned long)1,std::min((unsigned long)ZTS_MAX_WORKER_THREADS,(unsigned long)std::thread::hardware_concurrency()));
+		Mutex::Lock _l(_incomingPacketThreadsLock);
+		for(unsigned long t=0;t<_incomingPacketConcurrency;++t)
+			_incomingPacketThreads.push_back(std::thread([this,t]() { this->incomingPacketThreadMain(t); }));
+	}
+
+	/**
+	 * Stop and join all incoming packet threads (safe to call more than once)
+	 */
+	void stopIncomingPacketThreads()
+	{
+		_incomingPacketQueue.stop();
+		Mutex::Lock _l(_incomingPacketThreadsLock);
+		for(auto t=_incomingPacketThreads.begin();t!=_incomingPacketThreads.end();++t) {
+			if (t->joinable())
+				t->join();
+		}
+		_incomingPacketThreads.clear();
+	}
+
+	void incomingPacketThreadMain(unsigned long worker)
+	{
+#if defined(__linux__)
+		_wireSendDeferred = true;
+#endif
+		NodeServiceWorkerStats &stats = _workerStats[worker];
+		NodeServiceIncomingPacket *pkt = (NodeServiceIncomingPacket *)0;
+		_threadCount++;
+		for(;;) {
+			if (!_incomingPacketQueue.get(pkt))
+				break;
+			_threadWakeups++;
+			if (!pkt)
+				break;
+			if (!_run)
+				break;
+
+			const ZT_ResultCode rc = _node->processWirePacket(
+				(void *)0,
+				pkt->now,
+				pkt->sock,
+				&(pkt->from),
+				pkt->data,
+				pkt->size,
+				&_nextBackgroundTaskDeadline);
+			stats.packets.fetch_add(1,std::memory_order_relaxed);
+			stats.bytes.fetch_add(pkt->size,std::memory_order_relaxed);
+			{
+				Mutex::Lock _l(_incomingPacketMemoryPoolLock);
+				_incomingPacketMemoryPool.push_back(pkt);
+			}
+			// Once the queue runs dry hand any frames we produced to the stack right away
+			if (--_incomingPacketsPending == 0) {
+				flushTapRxBatches();
+				flushWireSends();
+			}
+			if (ZT_ResultCode_isFatal(rc)) {
+				char tmp[256];
+				OSUtils::ztsnprintf(tmp,sizeof(tmp),"fatal error code from processWirePacket: %d",(int)rc);
+				Mutex::Lock _l(_termReason_m);
+				_termReason = ONE_UNRECOVERABLE_ERROR;
+				_fatalErrorMessage = tmp;
+				this->terminate();
+				break;
+			}
+		}
+		_threadCount--;
+	}
+
+	inline void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
+	inline void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,const struct sockaddr *from) {}
+	void phyOnTcpClose(PhySocket *sock,void **uptr) {}
+	void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+	inline void phyOnTcpWritable(PhySocket *sock,void **uptr) {}
+	inline void phyOnFileDescriptorActivity(PhySocket *sock,void **uptr,bool readable,bool writable) {}
+	inline void phyOnUnixAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN) {}
+	inline void phyOnUnixClose(PhySocket *sock,void **uptr) {}
+	inline void phyOnUnixData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
+	inline void phyOnUnixWritable(PhySocket *sock,void **uptr) {}
+
+	inline int nodeVirtualNetworkConfigFunction(uint64_t nwid,void **nuptr,enum ZT_VirtualNetworkConfigOperation op,const ZT_VirtualNetworkConfig *nwc)
+	{
+		Mutex::Lock _l(_nets_m);
+		NetworkState &n = _nets[nwid];
+
+		switch(op) {
+
+			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_UP:
+				if (!n.tap) {
+					char friendlyName[128];
+					OSUtils::ztsnprintf(friendlyName,sizeof(friendlyName),"ZeroTier One [%.16llx]",nwid);
+
+					n.tap = new EthernetTap(
+						_homePath.c_str(),
+						MAC(nwc->mac),
+						nwc->mtu,
+						(unsigned int)ZT_IF_METRIC,
+						nwid,
+						friendlyName,
+						StapFrameHandler,
+						StapTxNotify,
+						(void *)this);
+					*nuptr = (void *)&n;
+				}
+				// After setting up tap, fall through to CONFIG_UPDATE since we also want to do this...
+
+			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_CONFIG_UPDATE:
+				memcpy(&(n.config),nwc,sizeof(ZT_VirtualNetworkConfig));
+				if (n.tap) { // sanity check
+					syncManagedStuff(n);
+					n.tap->setMtu(nwc->mtu);
+					if ((!n.neighborsSeeded)&&(n.tap->netif4))
+						seedNeighbors(nwid,n);
+					// A usable config right at UP can only be the cached one, the
+					// controller hasn't answered yet. Any later config is fresh.
+					if ((op == ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_UP)&&(allowProvisionalNetworks)&&(nwc->status == ZT_NETWORK_STATUS_OK)) {
+						if (!n.provisional) {
+							n.provisional = true;
+							++_provisionalNetworks;
+						}
+					} else if (n.provisional) {
+						n.provisional = false;
+						--_provisionalNetworks;
+						struct zts_network_details nd;
+						memset(&nd, 0, sizeof(nd));
+						nd.nwid = nwid;
+						_enqueueEvent(ZTS_EVENT_NETWORK_UPDATE, &nd);
+					}
+				} else {
+					_nets.erase(nwid);
+					publishNetworkSnapshot();
+					rebuildPathFilter();
+					return -999; // tap init failed
+				}
+				break;
+
+			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DOWN:
+			case ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DESTROY:
+				if (n.provisional)
+					--_provisionalNetworks;
+				if (n.tap) { // sanity check
+					*nuptr = (void *)0;
+					delete n.tap;
+					_nets.erase(nwid);
+					if (allowNetworkCaching) {
+						if (op == ZT_VIRTUAL_NETWORK_CONFIG_OPERATION_DESTROY) {
+							char nlcpath[256];
+							OSUtils::ztsnprintf(nlcpath,sizeof(nlcpath),"%s" ZT_PATH_SEPARATOR_S "networks.d" ZT_PATH_SEPARATOR_S "%.16llx.local.conf",_homePath.c_str(),nwid);
+							OSUtils::rm(nlcpath);
+							StateObjectKey k;
+							k.type = ZTS_STATE_OBJECT_NEIGHBORS;
+							k.id[0] = nwid;
+							k.id[1] = 0;
+							_stateCache.put(k,(const void *)0,-1,false);
+						}
+					}
+				} else {
+					_nets.erase(nwid);
+				}
+				break;
+		}
+		publishNetworkSnapshot();
+		rebuildPathFilter();
+		return 0;
+	}
+
+	/**
+	 * Compile the checks made by nodePathCheckFunction() and shouldBindInterface()
+	 * (assumes _nets_m is locked)
+	 */
+	void rebuildPathFilter()
+	{
+		std::shared_ptr<PathFilter> f(new PathFilter());
+		for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n) {
+			if (n->second.tap) {
+				std::vector<InetAddress> ips(n->second.tap->ips());
+				for(std::vector<InetAddress>::const_iterator i(ips.begin());i!=ips.end();++i) {
+					f->pathReject.addNetwork(*i);
+					f->bindReject.addAddress(*i);
+				}
+			}
+		}
+		{
+			Mutex::Lock _l(_localConfig_m);
+			for(std::vector<InetAddress>::const_iterator a(_globalV4Blacklist.begin());a!=_globalV4Blacklist.end();++a) {
+				f->pathReject.addNetwork(*a);
+				f->bindReject.addNetwork(*a);
+			}
+			for(std::vector<InetAddress>::const_iterator a(_globalV6Blacklist.begin());a!=_globalV6Blacklist.end();++a) {
+				f->pathReject.addNetwork(*a);
+				f->bindReject.addNetwork(*a);
+			}
+			Hashtable< uint64_t,std::vector<InetAddress> > *blh[2] = { &_v4Blacklists,&_v6Blacklists };
+			for(int k=0;k<2;++k) {
+				Hashtable< uint64_t,std::vector<InetAddress> >::Iterator i(*(blh[k]));
+				uint64_t *ztaddr = (uint64_t *)0;
+				std::vector<InetAddress> *l = (std::vector<InetAddress> *)0;
+				while (i.next(ztaddr,l)) {
+					PrefixTrie &t = f->peerBlacklists[*ztaddr];
+					for(std::vector<InetAddress>::const_iterator a(l->begin());a!=l->end();++a)
+						t.addNetwork(*a);
+				}
+			}
+		}
+		std::atomic_store(&_pathFilter,std::shared_ptr<const PathFilter>(f));
+	}
+
+	/**
+	 * Publish the current state of all networks for zts_get_*network* queries
+	 * (assumes _nets_m is locked)
+	 */
+	void publishNetworkSnapshot()
+	{
+		std::shared_ptr<NetworkSnapshot> snapshot(new NetworkSnapshot());
+		snapshot->networks.resize(_nets.size());
+		unsigned long i = 0;
+		for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n,++i) {
+			NetworkSnapshot::Network &net = snapshot->networks[i];
+			struct zts_network_details *nd = &(net.details);
+			memset(nd, 0, sizeof(struct zts_network_details));
+			nd->nwid = n->first;
+			nd->mtu = n->second.config.mtu;
+			nd->provisional = (n->second.provisional) ? 1 : 0;
+			nd->num_addresses = (short)std::min(n->second.managedIps.size(), (size_t)ZTS_MAX_ASSIGNED_ADDRESSES);
+			for(int j=0;j<nd->num_addresses;++j) {
+				const InetAddress &ip = n->second.managedIps[j];
+				memcpy(&(nd->addr[j]), &ip, ip.isV4() ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+			}
+			nd->num_routes = std::min(n->second.config.routeCount, (unsigned int)ZTS_MAX_NETWORK_ROUTES);
+			memcpy(nd->routes, n->second.config.routes, nd->num_routes * sizeof(ZT_VirtualNetworkRoute));
+			switch (n->second.config.status) {
 				case ZT_NETWORK_STATUS_REQUESTING_CONFIGURATION:
-					_enqueueEvent(ZTS_EVENT_NETWORK_REQ_CONFIG, (void*)prepare_network_details_msg(nwid));
+					net.status = ZTS_STATE_NETWORK_REQUESTING_CONFIG;
 					break;
 				case ZT_NETWORK_STATUS_OK:
-					if (tap->hasIpv4Addr() && _lwip_is_netif_up(tap->netif4)) {
-						_enqueueEvent(ZTS_EVENT_NETWORK_READY_IP4, (void*)prepare_network_details_msg(nwid));
-					}
-					if (tap->hasIpv6Addr() && _lwip_is_netif_up(tap->netif6)) {
-						_enqueueEvent(ZTS_EVENT_NETWORK_READY_IP6, (void*)prepare_network_details_msg(nwid));
-					}
-					// In addition to the READY messages, send one OK message
-					_enqueueEvent(ZTS_EVENT_NETWORK_OK, (void*)prepare_network_details_msg(nwid));
+					net.status = ZTS_STATE_NETWORK_OK;
 					break;
 				case ZT_NETWORK_STATUS_ACCESS_DENIED:
-					_enqueueEvent(ZTS_EVENT_NETWORK_ACCESS_DENIED, (void*)prepare_network_details_msg(nwid));
+					net.status = ZTS_STATE_NETWORK_ACCESS_DENIED;
+					break;
+				case ZT_NETWORK_STATUS_NOT_FOUND:
+					net.status = ZTS_STATE_NETWORK_NOT_FOUND;
+					break;
+				case ZT_NETWORK_STATUS_CLIENT_TOO_OLD:
+					net.status = ZTS_STATE_NETWORK_CLIENT_TOO_OLD;
 					break;
 				default:
+					net.status = ZTS_STATE_NETWORK_DOWN;
 					break;
 			}
-			n->second.tap->_networkStatus = mostRecentStatus;
+			snapshot->index.set(n->first, i);
 		}
+		_setNetworkSnapshot(snapshot);
+	}
 
-		// TODO: Add ZTS_EVENT_PEER_NEW
-		ZT_PeerList *pl = _node->peers();
-		struct zts_peer_details *pd;
-		if (pl) {
-			for(unsigned long i=0;i<pl->peerCount;++i) {
-				if (!peerCache.count(pl->peers[i].address)) {
-					// New peer, add status
-					if (pl->peers[i].pathCount > 0) {
-						pd = new zts_peer_details;
-						memcpy(pd, &(pl->peers[i]), sizeof(struct zts_peer_details));
-						_enqueueEvent(ZTS_EVENT_PEER_DIRECT, (void*)pd);
-					}
-					if (pl->peers[i].pathCount == 0) {
-						pd = new zts_peer_details;
-						memcpy(pd, &(pl->peers[i]), sizeof(struct zts_peer_details));
-						_enqueueEvent(ZTS_EVENT_PEER_RELAY, (void*)pd);
-					}
+	inline void nodeEventCallback(enum ZT_Event event,const void *metaData)
+	{
+		// Feed node events into lock-free queue for later dequeuing by the callback thread
+		switch(event) {
+			case ZT_EVENT_UP: {
+				_enqueueEvent(ZTS_EVENT_NODE_UP, NULL);
+			}	break;
+			case ZT_EVENT_ONLINE: {
+				int64_t notYet = 0;
+				_firstOnlineTime.compare_exchange_strong(notYet,OSUtils::now());
+				struct zts_node_details nd;
+				memset(&nd, 0, sizeof(nd));
+				nd.address = _node->address();
+				_enqueueEvent(ZTS_EVENT_NODE_ONLINE, &nd);
+			}	break;
+			case ZT_EVENT_OFFLINE: {
+				struct zts_node_details nd;
+				memset(&nd, 0, sizeof(nd));
+				nd.address = _node->address();
+				_enqueueEvent(ZTS_EVENT_NODE_OFFLINE, &nd);
+			}	break;
+			case ZT_EVENT_DOWN: {
+				struct zts_node_details nd;
+				memset(&nd, 0, sizeof(nd));
+				nd.address = _node->address();
+				_enqueueEvent(ZTS_EVENT_NODE_DOWN, &nd);
+			}	break;
+			case ZT_EVENT_FATAL_ERROR_IDENTITY_COLLISION: {
+				Mutex::Lock _l(_termReason_m);
+				_termReason = ONE_IDENTITY_COLLISION;
+				_fatalErrorMessage = "identity/address collision";
+				this->terminate();
+			}	break;
+
+			case ZT_EVENT_TRACE: {
+				if (metaData) {
+					::fprintf(stderr,"%s" ZT_EOL_S,(const char *)metaData);
+					::fflush(stderr);
 				}
-				// Previously known peer, update status
-				else {
-					if ((peerCache[pl->peers[i].address] == false) && pl->peers[i].pathCount > 0) {
-						pd = new zts_peer_details;
-						memcpy(pd, &(pl->peers[i]), sizeof(struct zts_peer_details));
-						_enqueueEvent(ZTS_EVENT_PEER_DIRECT, (void*)pd);
-					}
-					if ((peerCache[pl->peers[i].address] == true) && pl->peers[i].pathCount == 0) {
-						pd = new zts_peer_details;
-						memcpy(pd, &(pl->peers[i]), sizeof(struct zts_peer_details));
-						_enqueueEvent(ZTS_EVENT_PEER_RELAY, (void*)pd);
+			}	break;
+
+			default:
+				break;
+		}
+	}
+
+	inline void _stampNetworkReady()
+	{
+		int64_t notYet = 0;
+		_firstNetworkReadyTime.compare_exchange_strong(notYet,OSUtils::now());
+	}
+
+	inline void generateEventMsgs()
+	{
+		// Force the ordering of callback messages, these messages are only useful
+		// if the node and stack are both up and running. Provisional networks are
+		// usable before the node is online, so they are reported right away.
+		const bool online = _node->online();
+		if ((!online && !_provisionalNetworks) || !_lwip_is_up()) {
+			return;
+		}
+		{
+			// Generate messages to be dequeued by the callback message thread
+			Mutex::Lock _l(_nets_m);
+			for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
+				if (!online && !n->second.provisional) {
+					continue;
+				}
+				int mostRecentStatus = n->second.config.status;
+				VirtualTap *tap = n->second.tap;
+				uint64_t nwid = n->first;
+				if (n->second.tap->_networkStatus == mostRecentStatus) {
+					continue; // No state change
+				}
+				struct zts_network_details nd;
+				memset(&nd, 0, sizeof(nd));
+				nd.nwid = nwid;
+				nd.provisional = (n->second.provisional) ? 1 : 0;
+				switch (mostRecentStatus) {
+					case ZT_NETWORK_STATUS_NOT_FOUND:
+						_enqueueEvent(ZTS_EVENT_NETWORK_NOT_FOUND, &nd);
+						break;
+					case ZT_NETWORK_STATUS_CLIENT_TOO_OLD:
+						_enqueueEvent(ZTS_EVENT_NETWORK_CLIENT_TOO_OLD, &nd);
+						break;
+					case ZT_NETWORK_STATUS_REQUESTING_CONFIGURATION:
+						_enqueueEvent(ZTS_EVENT_NETWORK_REQ_CONFIG, &nd);
+						break;
+					case ZT_NETWORK_STATUS_OK:
+						if (tap->hasIpv4Addr() && _lwip_is_netif_up(tap->netif4)) {
+							_enqueueEvent(ZTS_EVENT_NETWORK_READY_IP4, &nd);
+							_stampNetworkReady();
+						}
+						if (tap->hasIpv6Addr() && _lwip_is_netif_up(tap->netif6)) {
+							_enqueueEvent(ZTS_EVENT_NETWORK_READY_IP6, &nd);
+							_stampNetworkReady();
+						}
+						// In addition to the READY messages, send one OK message
+						_enqueueEvent(ZTS_EVENT_NETWORK_OK, &nd);
+						break;
+					case ZT_NETWORK_STATUS_ACCESS_DENIED:
+						_enqueueEvent(ZTS_EVENT_NETWORK_ACCESS_DENIED, &nd);
+						break;
+					default:
+						break;
+				}
+				n->second.tap->_networkStatus = mostRecentStatus;
+			}
+		}
+
+	}
+
+	/**
+	 * Settle networks brought up from their cached config (see zts_allow_provisional_networks())
+	 *
+	 * A fresh config arrives as a config update and settles the network right
+	 * there. The core doesn't report a fresh config equal to the cached one, so
+	 * a network still OK once the node has been online for a while counts as
+	 * confirmed. If the core reports it denied or gone instead, the cached
+	 * addresses and routes are dropped.
+	 */
+	void reconcileProvisionalNetworks(int64_t now)
+	{
+		std::vector<uint64_t> nwids;
+		{
+			Mutex::Lock _l(_nets_m);
+			for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n) {
+				if (n->second.provisional)
+					nwids.push_back(n->first);
+			}
+		}
+		const int64_t onlineTime = _firstOnlineTime.load();
+		const bool settled = ((onlineTime)&&((now - onlineTime) >= ZTS_PROVISIONAL_CONFIRM_TIMEOUT));
+		for(std::vector<uint64_t>::const_iterator nwid(nwids.begin());nwid!=nwids.end();++nwid) {
+			ZT_VirtualNetworkConfig *nc = _node->networkConfig(*nwid);
+			if (!nc) {
+				continue;
+			}
+			const bool rejected = ((nc->status != ZT_NETWORK_STATUS_OK)&&(nc->status != ZT_NETWORK_STATUS_REQUESTING_CONFIGURATION));
+			if ((rejected)||(settled)) {
+				Mutex::Lock _l(_nets_m);
+				std::map<uint64_t,NetworkState>::iterator n(_nets.find(*nwid));
+				if ((n != _nets.end())&&(n->second.provisional)&&(n->second.tap)) {
+					n->second.provisional = false;
+					--_provisionalNetworks;
+					if (rejected) {
+						memcpy(&(n->second.config),nc,sizeof(ZT_VirtualNetworkConfig));
+						n->second.config.assignedAddressCount = 0;
+						n->second.config.routeCount = 0;
+						syncManagedStuff(n->second);
 					}
+					struct zts_network_details nd;
+					memset(&nd, 0, sizeof(nd));
+					nd.nwid = *nwid;
+					_enqueueEvent(ZTS_EVENT_NETWORK_UPDATE, &nd);
+					publishNetworkSnapshot();
+					rebuildPathFilter();
 				}
-				// Update our cache with most recently observed path count
-				peerCache[pl->peers[i].address] = pl->peers[i].pathCount;
 			}
+			_node->freeQueryResult((void *)nc);
+		}
+	}
+
+	/**
+	 * Save the physical paths peers were last heard on, read back by loadPathHints()
+	 *
+	 * A restarted node otherwise reaches every peer through a root first and
+	 * only goes direct once it has learned its path again.
+	 */
+	inline void savePathHints()
+	{
+		if ((!allowPeerCaching)||(!_firstOnlineTime))
+			return; // Nothing learned this time, keep what the last run saved
+		ZT_PeerList *pl = _node->peers();
+		if (!pl)
+			return;
+		const int64_t now = OSUtils::now();
+		std::string hints;
+		char line[128],abuf[64];
+		for(unsigned long i=0;i<pl->peerCount;++i) {
+			if (pl->peers[i].role == ZT_PEER_ROLE_PLANET)
+				continue; // Known from the planet anyway
+			for(unsigned int j=0;j<pl->peers[i].pathCount;++j) {
+				const ZT_PeerPhysicalPath &p = pl->peers[i].paths[j];
+				if ((p.expired)||((now - (int64_t)p.lastReceive) > ZTS_PATH_HINT_MAX_AGE))
+					continue;
+				const InetAddress a(p.address);
+				OSUtils::ztsnprintf(line,sizeof(line),"%.10llx %s\n",(unsigned long long)pl->peers[i].address,a.toString(abuf));
+				if ((hints.length() + strlen(line)) <= ZTS_PATH_HINTS_MAX_SIZE)
+					hints.append(line);
+			}
+		}
+		_node->freeQueryResult((void *)pl);
+		StateObjectKey k;
+		k.type = ZTS_STATE_OBJECT_PATH_HINTS;
+		k.id[0] = 0;
+		k.id[1] = 0;
+		_stateCache.put(k,hints.data(),(hints.length() > 0) ? (int)hints.length() : -1,true);
+	}
+
+	/**
+	 * Fill _v4Hints and _v6Hints from the paths saved by the last run
+	 *
+	 * The core asks for them (see nodePathLookupFunction()) when it has no
+	 * direct path to a peer, and tries them alongside the relayed route.
+	 */
+	inline void loadPathHints()
+	{
+		_v4Hints.clear();
+		_v6Hints.clear();
+		if (!allowPeerCaching)
+			return;
+		StateObjectKey k;
+		k.type = ZTS_STATE_OBJECT_PATH_HINTS;
+		k.id[0] = 0;
+		k.id[1] = 0;
+		std::vector<char> buf(ZTS_PATH_HINTS_MAX_SIZE + 1);
+		const int n = _stateCache.get(k,buf.data(),ZTS_PATH_HINTS_MAX_SIZE);
+		if (n <= 0)
+			return;
+		buf[n] = 0;
+		char *saveptr = (char *)0;
+		for(char *l=Utils::stok(buf.data(),"\r\n",&saveptr);l;l=Utils::stok((char *)0,"\r\n",&saveptr)) {
+			char *sp = strchr(l,' ');
+			if (!sp)
+				continue;
+			*(sp++) = 0;
+			const uint64_t ztaddr = Utils::hexStrToU64(l) & 0xffffffffffULL;
+			InetAddress a;
+			if ((!ztaddr)||(!a.fromString(sp)))
+				continue;
+			if (a.isV4())
+				_v4Hints[ztaddr].push_back(a);
+			else if (a.isV6())
+				_v6Hints[ztaddr].push_back(a);
+		}
+	}
+
+	/**
+	 * Save the ARP entries of a network's tap, restored by seedNeighbors() on the next start
+	 *
+	 * Entries still held static from the last start were never confirmed by
+	 * ARP and are left out. Must be called with _nets_m held.
+	 */
+	inline void saveNeighbors(uint64_t nwid,NetworkState &n)
+	{
+		if ((!allowNetworkCaching)||(!_firstOnlineTime)||(!n.tap)||(!n.tap->netif4))
+			return;
+		std::vector< std::pair<InetAddress,MAC> > entries;
+		_lwip_get_arp_entries(n.tap->netif4,entries);
+		std::string neighbors;
+		char line[64],ipbuf[64];
+		for(std::vector< std::pair<InetAddress,MAC> >::iterator e(entries.begin());e!=entries.end();++e) {
+			if (std::find(_seededNeighbors.begin(),_seededNeighbors.end(),e->first) != _seededNeighbors.end())
+				continue;
+			OSUtils::ztsnprintf(line,sizeof(line),"%s %.12llx\n",e->first.toIpString(ipbuf),(unsigned long long)e->second.toInt());
+			if ((neighbors.length() + strlen(line)) <= ZTS_NEIGHBORS_MAX_SIZE)
+				neighbors.append(line);
+		}
+		StateObjectKey k;
+		k.type = ZTS_STATE_OBJECT_NEIGHBORS;
+		k.id[0] = nwid;
+		k.id[1] = 0;
+		_stateCache.put(k,neighbors.data(),(neighbors.length() > 0) ? (int)neighbors.length() : -1,true);
+	}
+
+	/**
+	 * Add the ARP entries saved for a network as static entries once its tap has an IPv4 address
+	 *
+	 * Traffic to hosts seen in the last run then goes out without waiting for
+	 * ARP, which is slow while peers are still being reached through a root.
+	 * They are dropped after ZTS_NEIGHBOR_SEED_LIFETIME as static entries are
+	 * never refreshed. Must be called with _nets_m held.
+	 */
+	inline void seedNeighbors(uint64_t nwid,NetworkState &n)
+	{
+		n.neighborsSeeded = true;
+		if (!allowNetworkCaching)
+			return;
+		StateObjectKey k;
+		k.type = ZTS_STATE_OBJECT_NEIGHBORS;
+		k.id[0] = nwid;
+		k.id[1] = 0;
+		char buf[ZTS_NEIGHBORS_MAX_SIZE + 1];
+		const int len = _stateCache.get(k,buf,ZTS_NEIGHBORS_MAX_SIZE);
+		if (len <= 0)
+			return;
+		buf[len] = 0;
+		bool seeded = false;
+		char *saveptr = (char *)0;
+		for(char *l=Utils::stok(buf,"\r\n",&saveptr);l;l=Utils::stok((char *)0,"\r\n",&saveptr)) {
+			char *sp = strchr(l,' ');
+			if (!sp)
+				continue;
+			*(sp++) = 0;
+			InetAddress ip;
+			const MAC mac(Utils::hexStrToU64(sp));
+			if ((!ip.fromString(l))||(!ip.isV4())||(!mac))
+				continue;
+			if (_lwip_add_static_arp_entry(ip,mac)) {
+				_seededNeighbors.push_back(ip);
+				seeded = true;
+			}
+		}
+		if (seeded)
+			_neighborSeedExpiry = OSUtils::now() + ZTS_NEIGHBOR_SEED_LIFETIME;
+	}
+
+	/**
+	 * Remove the static ARP entries added by seedNeighbors(), must be called with _nets_m held
+	 */
+	inline void releaseNeighborSeeds()
+	{
+		for(std::vector<InetAddress>::iterator ip(_seededNeighbors.begin());ip!=_seededNeighbors.end();++ip)
+			_lwip_remove_static_arp_entry(*ip);
+		_seededNeighbors.clear();
+		_neighborSeedExpiry = 0;
+	}
+
+	/**
+	 * Publish a new peer snapshot and report direct/relay transitions
+	 *
+	 * Peer transitions are not reported by the core, so the peer list is
+	 * scanned, but at a bounded interval rather than on every loop.
+	 */
+	inline void scanPeers()
+	{
+		std::shared_ptr<const PeerSnapshot> snapshot(publishPeerSnapshot());
+		if (snapshot) {
+			generatePeerEventMsgs(*snapshot);
+		}
+	}
+
+	virtual void refreshPeerSnapshot()
+	{
+		publishPeerSnapshot();
+	}
+
+	/**
+	 * Fetch the node's peer list and publish it as the new peer snapshot
+	 *
+	 * @return The snapshot, or NULL if there is no node or it returned no peer list
+	 */
+	std::shared_ptr<const PeerSnapshot> publishPeerSnapshot()
+	{
+		Mutex::Lock _l(_peerScan_m);
+		if (!_peerScanReady) {
+			return std::shared_ptr<const PeerSnapshot>();
+		}
+		ZT_PeerList *pl = _node->peers();
+		if (!pl) {
+			return std::shared_ptr<const PeerSnapshot>();
+		}
+		std::shared_ptr<PeerSnapshot> snapshot(new PeerSnapshot());
+		snapshot->online = _node->online();
+		snapshot->timestamp = OSUtils::now();
+		snapshot->peers.resize(pl->peerCount);
+		for(unsigned long i=0;i<pl->peerCount;++i) {
+			memcpy(&(snapshot->peers[i]), &(pl->peers[i]), sizeof(struct zts_peer_details));
+			for (unsigned int j=0; j<pl->peers[i].pathCount; j++) {
+				memcpy(&(snapshot->peers[i].paths[j].address),
+					&(pl->peers[i].paths[j].address), sizeof(struct sockaddr_storage));
+			}
+			snapshot->index.set(pl->peers[i].address, i);
 		}
 		_node->freeQueryResult((void *)pl);
+		_setPeerSnapshot(snapshot);
+		return snapshot;
+	}
+
+	inline void generatePeerEventMsgs(const PeerSnapshot &snapshot)
+	{
+		// Same ordering rule as generateEventMsgs()
+		if (!snapshot.online || !_lwip_is_up()) {
+			return;
+		}
+		// TODO: Add ZTS_EVENT_PEER_NEW
+		if (!_isEventEnabled(ZTS_EVENT_MASK_PEER)) {
+			return;
+		}
+		const uint64_t gen = ++_peerCacheGeneration;
+		for(unsigned long i=0;i<snapshot.peers.size();++i) {
+			const struct zts_peer_details &p = snapshot.peers[i];
+			const bool direct = (p.pathCount > 0);
+			PeerCacheEntry *e = _peerCache.get(p.address);
+			if ((!e)||(e->direct != direct)) {
+				// New peer or changed status
+				_enqueueEvent(direct ? ZTS_EVENT_PEER_DIRECT : ZTS_EVENT_PEER_RELAY, &p);
+			}
+			if (!e) {
+				e = &(_peerCache[p.address]);
+			}
+			e->direct = direct;
+			e->generation = gen;
+		}
+
+		// Forget peers the core no longer knows, so the cache doesn't grow forever
+		if (_peerCache.size() > snapshot.peers.size()) {
+			Hashtable< uint64_t,PeerCacheEntry >::Iterator c(_peerCache);
+			uint64_t *a = (uint64_t *)0;
+			PeerCacheEntry *e = (PeerCacheEntry *)0;
+			while (c.next(a,e)) {
+				if (e->generation != gen)
+					_peerCache.erase(*a);
+			}
+		}
 	}
 
 	inline size_t networkCount()
@@ -873,130 +2295,93 @@ public:
 		}
 	}
 
-	inline int getPeerStatus(uint64_t id)
+	inline void getServiceStats(struct zts_stats_service *stats)
 	{
-		ZT_PeerList *pl = _node->peers();
-		int status = ZTS_EVENT_PEER_UNREACHABLE;
-		if (pl) {
-			for(unsigned long i=0;i<pl->peerCount;++i) {
-				if (pl->peers[i].address == id) {
-					status = pl->peers[i].pathCount > 0 ? ZTS_EVENT_PEER_DIRECT : ZTS_EVENT_PEER_RELAY;
-					break;
-				}
-			}
+		stats->worker_count = (uint32_t)_incomingPacketConcurrency;
+		for(unsigned long i=0;(i<_incomingPacketConcurrency)&&(i<ZTS_MAX_WORKER_THREADS);++i) {
+			stats->workers[i].packets = _workerStats[i].packets.load(std::memory_order_relaxed);
+			stats->workers[i].bytes = _workerStats[i].bytes.load(std::memory_order_relaxed);
 		}
-		_node->freeQueryResult((void *)pl);
-		return status;
+#if defined(__linux__)
+		stats->shard_count = (uint32_t)_portShards.size();
+		for(unsigned long i=0;(i<_portShards.size())&&(i<ZTS_MAX_PORT_SHARDS);++i) {
+			stats->shards[i].packets = _portShards[i]->stats.packets.load(std::memory_order_relaxed);
+			stats->shards[i].bytes = _portShards[i]->stats.bytes.load(std::memory_order_relaxed);
+		}
+#endif
+		stats->thread_count = _threadCount.load();
+		stats->wakeups = _threadWakeups.load();
+		stats->events_dropped = _eventsDropped.load();
+		const int64_t startTime = _startTime.load();
+		const int64_t onlineTime = _firstOnlineTime.load();
+		const int64_t readyTime = _firstNetworkReadyTime.load();
+		if (onlineTime)
+			stats->time_to_online = (uint32_t)(onlineTime - startTime);
+		if (readyTime)
+			stats->time_to_network_ready = (uint32_t)(readyTime - startTime);
+		stats->state_load_time = _stateLoadTime.load();
+		stats->state_objects_loaded = _stateObjectsLoaded.load();
+		Mutex::Lock _l(_wakeupSample_m);
+		const int64_t now = OSUtils::now();
+		if ((_lastWakeupSampleTime)&&(now > _lastWakeupSampleTime))
+			stats->wakeups_per_sec = (uint32_t)(((stats->wakeups - _lastWakeupSample) * 1000) / (uint64_t)(now - _lastWakeupSampleTime));
+		_lastWakeupSample = stats->wakeups;
+		_lastWakeupSampleTime = now;
 	}
 
-	inline void nodeStatePutFunction(enum ZT_StateObjectType type,const uint64_t id[2],const void *data,int len)
+	// Core's state object types as ZTS_STATE_OBJECT_*, or 0 for those not kept
+	static inline int _stateObjectType(enum ZT_StateObjectType type)
 	{
-		char p[1024];
-		FILE *f;
-		bool secure = false;
-		char dirname[1024];
-		dirname[0] = 0;
-
 		switch(type) {
 			case ZT_STATE_OBJECT_IDENTITY_PUBLIC:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "identity.public",_homePath.c_str());
-				break;
+				return ZTS_STATE_OBJECT_IDENTITY_PUBLIC;
 			case ZT_STATE_OBJECT_IDENTITY_SECRET:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "identity.secret",_homePath.c_str());
-				secure = true;
-				break;
+				return ZTS_STATE_OBJECT_IDENTITY_SECRET;
 			case ZT_STATE_OBJECT_PLANET:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "planet",_homePath.c_str());
-				break;
+				return ZTS_STATE_OBJECT_PLANET;
 			case ZT_STATE_OBJECT_NETWORK_CONFIG:
-				if (allowNetworkCaching) {
-					OSUtils::ztsnprintf(dirname,sizeof(dirname),"%s" ZT_PATH_SEPARATOR_S "networks.d",_homePath.c_str());
-					OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "%.16llx.conf",dirname,(unsigned long long)id[0]);
-					secure = true;
-				}
-				else {
-					return;
-				}
-				break;
+				return (allowNetworkCaching) ? ZTS_STATE_OBJECT_NETWORK_CONFIG : 0;
 			case ZT_STATE_OBJECT_PEER:
-				if (allowPeerCaching) {
-					OSUtils::ztsnprintf(dirname,sizeof(dirname),"%s" ZT_PATH_SEPARATOR_S "peers.d",_homePath.c_str());
-					OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "%.10llx.peer",dirname,(unsigned long long)id[0]);
-				}
-				break;
+				return (allowPeerCaching) ? ZTS_STATE_OBJECT_PEER : 0;
 			default:
-				return;
-		}
-
-		if (len >= 0) {
-			// Check to see if we've already written this first. This reduces
-			// redundant writes and I/O overhead on most platforms and has
-			// little effect on others.
-			f = fopen(p,"rb");
-			if (f) {
-				char buf[65535];
-				long l = (long)fread(buf,1,sizeof(buf),f);
-				fclose(f);
-				if ((l == (long)len)&&(memcmp(data,buf,l) == 0))
-					return;
-			}
-
-			f = fopen(p,"wb");
-			if ((!f)&&(dirname[0])) { // create subdirectory if it does not exist
-				OSUtils::mkdir(dirname);
-				f = fopen(p,"wb");
-			}
-			if (f) {
-				if (fwrite(data,len,1,f) != 1)
-					fprintf(stderr,"WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S,p);
-				fclose(f);
-				if (secure)
-					OSUtils::lockDownFile(p,false);
-			} else {
-				fprintf(stderr,"WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S,p);
-			}
-		} else {
-			OSUtils::rm(p);
+				return 0;
 		}
 	}
 
+	inline void nodeStatePutFunction(enum ZT_StateObjectType type,const uint64_t id[2],const void *data,int len)
+	{
+		StateObjectKey k;
+		k.type = _stateObjectType(type);
+		if (!k.type)
+			return;
+		if ((_userProvidedIdentity.length())&&((k.type == ZTS_STATE_OBJECT_IDENTITY_SECRET)||(k.type == ZTS_STATE_OBJECT_IDENTITY_PUBLIC)))
+			return; // Injected, kept only in memory
+		k.id[0] = id[0];
+		k.id[1] = id[1];
+		// Identities and the planet are written right away, peers and network
+		// configs change often and are coalesced over the flush interval
+		const bool urgent = ((k.type != ZTS_STATE_OBJECT_PEER)&&(k.type != ZTS_STATE_OBJECT_NETWORK_CONFIG));
+		_stateCache.put(k,data,len,urgent);
+	}
+
 	inline int nodeStateGetFunction(enum ZT_StateObjectType type,const uint64_t id[2],void *data,unsigned int maxlen)
 	{
-		char p[4096];
-		switch(type) {
-			case ZT_STATE_OBJECT_IDENTITY_PUBLIC:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "identity.public",_homePath.c_str());
-				break;
-			case ZT_STATE_OBJECT_IDENTITY_SECRET:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "identity.secret",_homePath.c_str());
-				break;
-			case ZT_STATE_OBJECT_PLANET:
-				OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "planet",_homePath.c_str());
-				break;
-			case ZT_STATE_OBJECT_NETWORK_CONFIG:
-				if (allowNetworkCaching) {
-					OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "networks.d" ZT_PATH_SEPARATOR_S "%.16llx.conf",_homePath.c_str(),(unsigned long long)id[0]);
-				}
-				else {
-					return -1;
-				}
-				break;
-			case ZT_STATE_OBJECT_PEER:
-				if (allowPeerCaching) {
-					OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "peers.d" ZT_PATH_SEPARATOR_S "%.10llx.peer",_homePath.c_str(),(unsigned long long)id[0]);
-				}
-				break;
-			default:
-				return -1;
-		}
-		FILE *f = fopen(p,"rb");
-		if (f) {
-			int n = (int)fread(data,1,maxlen,f);
-			fclose(f);
-			if (n >= 0)
-				return n;
+		StateObjectKey k;
+		k.type = _stateObjectType(type);
+		if (!k.type)
+			return -1;
+		if (_userProvidedIdentity.length()) {
+			if (k.type == ZTS_STATE_OBJECT_IDENTITY_SECRET) {
+				const unsigned int n = std::min((unsigned int)_userProvidedIdentity.length(),maxlen);
+				memcpy(data,_userProvidedIdentity.data(),n);
+				return (int)n;
+			}
+			if (k.type == ZTS_STATE_OBJECT_IDENTITY_PUBLIC)
+				return -1; // The core derives it from the secret one
 		}
-		return -1;
+		k.id[0] = id[0];
+		k.id[1] = id[1];
+		return _stateCache.get(k,data,maxlen);
 	}
 
 	inline int nodeWirePacketSendFunction(const int64_t localSocket,const struct sockaddr_storage *addr,const void *data,unsigned int len,unsigned int ttl)
@@ -1005,7 +2390,34 @@ public:
 		// working we can instantly "fail forward" to it and stop using TCP
 		// proxy fallback, which is slow.
 
+#if defined(__linux__)
+		NodeServicePortShard *shard = (NodeServicePortShard *)0;
+		const int shardFd = _portShardFd(localSocket,&shard);
+		if (shardFd >= 0) {
+#ifdef ZTS_IO_URING
+			if ((shard->ring)&&(!ttl)&&(shard->ring->send(shardFd,addr,data,len))) {
+				// Threads that flush on their own submit the whole batch later
+				if (!_wireSendDeferred)
+					shard->ring->flush();
+				return 0;
+			}
+#endif
+			if ((_wireBatchSize)&&(_wireSendDeferred)&&(!ttl))
+				return ((queueWireSend(localSocket,shardFd,addr,data,len)) ? 0 : -1);
+			int t = (int)ttl;
+			if ((ttl)&&(addr->ss_family == AF_INET)) ::setsockopt(shardFd,IPPROTO_IP,IP_TTL,(void *)&t,sizeof(t));
+			const bool r = (::sendto(shardFd,data,len,0,(const struct sockaddr *)addr,(addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == (ssize_t)len);
+			t = 255;
+			if ((ttl)&&(addr->ss_family == AF_INET)) ::setsockopt(shardFd,IPPROTO_IP,IP_TTL,(void *)&t,sizeof(t));
+			return ((r) ? 0 : -1);
+		}
+#endif
 		if ((localSocket != -1)&&(localSocket != 0)&&(_binder.isUdpSocketValid((PhySocket *)((uintptr_t)localSocket)))) {
+#if defined(__linux__)
+			// Coalesce on threads that flush on their own, sends with a TTL change go out right away
+			if ((_wireBatchSize)&&(_wireSendDeferred)&&(!ttl))
+				return ((queueWireSend(localSocket,(int)_phy.getDescriptor((PhySocket *)((uintptr_t)localSocket)),addr,data,len)) ? 0 : -1);
+#endif
 			if ((ttl)&&(addr->ss_family == AF_INET)) _phy.setIp4UdpTtl((PhySocket *)((uintptr_t)localSocket),ttl);
 			const bool r = _phy.udpSend((PhySocket *)((uintptr_t)localSocket),(const struct sockaddr *)addr,data,len);
 			if ((ttl)&&(addr->ss_family == AF_INET)) _phy.setIp4UdpTtl((PhySocket *)((uintptr_t)localSocket),255);
@@ -1023,22 +2435,54 @@ public:
 		n->tap->put(MAC(sourceMac),MAC(destMac),etherType,data,len);
 	}
 
-	inline int nodePathCheckFunction(uint64_t ztaddr,const int64_t localSocket,const struct sockaddr_storage *remoteAddr)
+	/**
+	 * Deliver any inbound frames still queued on the taps to the stack
+	 */
+	inline void flushTapRxBatches()
+	{
+		Mutex::Lock _l(_nets_m);
+		for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
+			if (n->second.tap)
+				n->second.tap->flushRx();
+		}
+	}
+
+	/**
+	 * Send any outbound frames the stack has queued on the taps
+	 */
+	inline void flushTapTxQueues()
 	{
-		// Make sure we're not trying to do ZeroTier-over-ZeroTier
 		{
 			Mutex::Lock _l(_nets_m);
-			for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n) {
-				if (n->second.tap) {
-					std::vector<InetAddress> ips(n->second.tap->ips());
-					for(std::vector<InetAddress>::const_iterator i(ips.begin());i!=ips.end();++i) {
-						if (i->containsAddress(*(reinterpret_cast<const InetAddress *>(remoteAddr)))) {
-							return 0;
-						}
-					}
-				}
+			for(std::map<uint64_t,NetworkState>::iterator n(_nets.begin());n!=_nets.end();++n) {
+				if ((n->second.tap)&&(n->second.tap->dequeueTx(_txBatch)))
+					_txBatchNwids.resize(_txBatch.size(),n->first);
 			}
 		}
+		// The core may call back into this service (and take _nets_m) while sending
+		if (!_txBatch.empty())
+			_lwip_eth_tx_submit(StapFrameHandler,(void *)this,_txBatchNwids,_txBatch);
+	}
+
+	inline void flushTapQueues()
+	{
+		flushTapRxBatches();
+		flushTapTxQueues();
+	}
+
+	inline void tapTxNotify()
+	{
+		_phy.whack();
+	}
+
+	inline int nodePathCheckFunction(uint64_t ztaddr,const int64_t localSocket,const struct sockaddr_storage *remoteAddr)
+	{
+		const std::shared_ptr<const PathFilter> f(std::atomic_load(&_pathFilter));
+		const InetAddress &ra = *(reinterpret_cast<const InetAddress *>(remoteAddr));
+
+		// Make sure we're not trying to do ZeroTier-over-ZeroTier, also checks the global blacklists
+		if (f->pathReject.contains(ra))
+			return 0;
 
 		/* Note: I do not think we need to scan for overlap with managed routes
 		 * because of the "route forking" and interface binding that we do. This
@@ -1046,32 +2490,10 @@ public:
 		 * path even if its managed routes override this for other traffic. Will
 		 * revisit if we see recursion problems. */
 
-		// Check blacklists
-		const Hashtable< uint64_t,std::vector<InetAddress> > *blh = (const Hashtable< uint64_t,std::vector<InetAddress> > *)0;
-		const std::vector<InetAddress> *gbl = (const std::vector<InetAddress> *)0;
-		if (remoteAddr->ss_family == AF_INET) {
-			blh = &_v4Blacklists;
-			gbl = &_globalV4Blacklist;
-		} else if (remoteAddr->ss_family == AF_INET6) {
-			blh = &_v6Blacklists;
-			gbl = &_globalV6Blacklist;
-		}
-		if (blh) {
-			Mutex::Lock _l(_localConfig_m);
-			const std::vector<InetAddress> *l = blh->get(ztaddr);
-			if (l) {
-				for(std::vector<InetAddress>::const_iterator a(l->begin());a!=l->end();++a) {
-					if (a->containsAddress(*reinterpret_cast<const InetAddress *>(remoteAddr)))
-						return 0;
-				}
-			}
-		}
-		if (gbl) {
-			for(std::vector<InetAddress>::const_iterator a(gbl->begin());a!=gbl->end();++a) {
-				if (a->containsAddress(*reinterpret_cast<const InetAddress *>(remoteAddr)))
-					return 0;
-			}
-		}
+		// Check per-peer blacklists
+		const PrefixTrie *bl = f->peerBlacklists.get(ztaddr);
+		if ((bl)&&(bl->contains(ra)))
+			return 0;
 		return 1;
 	}
 
@@ -1122,34 +2544,9 @@ public:
 					return false;
 			}
 		}
-		{
-			// Check global blacklists
-			const std::vector<InetAddress> *gbl = (const std::vector<InetAddress> *)0;
-			if (ifaddr.ss_family == AF_INET) {
-				gbl = &_globalV4Blacklist;
-			} else if (ifaddr.ss_family == AF_INET6) {
-				gbl = &_globalV6Blacklist;
-			}
-			if (gbl) {
-				Mutex::Lock _l(_localConfig_m);
-				for(std::vector<InetAddress>::const_iterator a(gbl->begin());a!=gbl->end();++a) {
-					if (a->containsAddress(ifaddr))
-						return false;
-				}
-			}
-		}
-		{
-			Mutex::Lock _l(_nets_m);
-			for(std::map<uint64_t,NetworkState>::const_iterator n(_nets.begin());n!=_nets.end();++n) {
-				if (n->second.tap) {
-					std::vector<InetAddress> ips(n->second.tap->ips());
-					for(std::vector<InetAddress>::const_iterator i(ips.begin());i!=ips.end();++i) {
-						if (i->ipsEqual(ifaddr))
-							return false;
-					}
-				}
-			}
-		}
+		// Skip our own tap addresses and the global blacklists
+		if (std::atomic_load(&_pathFilter)->bindReject.contains(ifaddr))
+			return false;
 
 		return true;
 	}
@@ -1209,6 +2606,15 @@ static int SnodePathLookupFunction(ZT_Node *node,void *uptr,void *tptr,uint64_t
 static void StapFrameHandler(void *uptr,void *tptr,uint64_t nwid,const MAC &from,const MAC &to,unsigned int etherType,unsigned int vlanId,const void *data,unsigned int len)
 { reinterpret_cast<NodeServiceImpl *>(uptr)->tapFrameHandler(nwid,from,to,etherType,vlanId,data,len); }
 
+static void StapTxNotify(void *uptr)
+{ reinterpret_cast<NodeServiceImpl *>(uptr)->tapTxNotify(); }
+#ifdef ZTS_IO_URING
+static bool SportShardDatagram(void *arg,int fd,const struct sockaddr_storage *from,const void *data,unsigned int len,unsigned int segSize)
+{ NodeServicePortShard *s = reinterpret_cast<NodeServicePortShard *>(arg); return reinterpret_cast<NodeServiceImpl *>(s->service)->portShardDatagram(s,fd,from,data,len,segSize); }
+static void SportShardBatchDone(void *arg)
+{ NodeServicePortShard *s = reinterpret_cast<NodeServicePortShard *>(arg); reinterpret_cast<NodeServiceImpl *>(s->service)->portShardBatchDone(); }
+#endif
+
 
 std::string NodeService::platformDefaultHomePath()
 {
@@ -1227,6 +2633,16 @@ NodeService *service;
 // Lock to guard access to ZeroTier core service
 Mutex serviceLock;
 
+// Notified by the NodeService thread once it has deleted the service
+static std::mutex serviceExitLock;
+static std::condition_variable serviceExited;
+
+void _waitForNodeServiceExit()
+{
+	std::unique_lock<std::mutex> l(serviceExitLock);
+	serviceExited.wait(l, []() { Mutex::Lock _l(serviceLock); return !service; });
+}
+
 // Starts a ZeroTier NodeService background thread
 #if defined(__WINDOWS__)
 DWORD WINAPI _runNodeService(LPVOID arg)
@@ -1237,15 +2653,18 @@ void *_runNodeService(void *arg)
 #if defined(__APPLE__)
 	pthread_setname_np(ZTS_SERVICE_THREAD_NAME);
 #endif
+	_threadCount++;
 	struct serviceParameters *params = (struct serviceParameters *)arg;
 	int err;
 	try {
+		// State kept in memory or by the application doesn't need the home path
+		const bool useHomePath = ((stateBackend == ZTS_STATE_BACKEND_FILES)||(stateBackend == ZTS_STATE_BACKEND_LOG));
 		std::vector<std::string> hpsp(OSUtils::split(params->path.c_str(), ZT_PATH_SEPARATOR_S,"",""));
 		std::string ptmp;
 		if (params->path[0] == ZT_PATH_SEPARATOR) {
 			ptmp.push_back(ZT_PATH_SEPARATOR);
 		}
-		for (std::vector<std::string>::iterator pi(hpsp.begin());pi!=hpsp.end();++pi) {
+		for (std::vector<std::string>::iterator pi(hpsp.begin());(useHomePath)&&(pi!=hpsp.end());++pi) {
 			if (ptmp.length() > 0) {
 				ptmp.push_back(ZT_PATH_SEPARATOR);
 			}
@@ -1263,6 +2682,7 @@ void *_runNodeService(void *arg)
 			service = NodeService::newInstance(params->path.c_str(),params->port);
 			service->_userProvidedPort = params->port;
 			service->_userProvidedPath = params->path;
+			service->_userProvidedIdentity = params->identity;
 			serviceLock.unlock();
 			switch(service->run()) {
 				case NodeService::ONE_STILL_RUNNING:
@@ -1278,12 +2698,30 @@ void *_runNodeService(void *arg)
 					err = true;
 					delete service;
 					service = (NodeService *)0;
-					std::string oldid;
-					OSUtils::readFile((params->path + ZT_PATH_SEPARATOR_S + "identity.secret").c_str(),oldid);
-					if (oldid.length()) {
-						OSUtils::writeFile((params->path + ZT_PATH_SEPARATOR_S + "identity.secret.saved_after_collision").c_str(),oldid);
-						OSUtils::rm((params->path + ZT_PATH_SEPARATOR_S + "identity.secret").c_str());
-						OSUtils::rm((params->path + ZT_PATH_SEPARATOR_S + "identity.public").c_str());
+					if (params->identity.length()) {
+						// The injected identity collided, leave the stored one alone and continue with it (or a new one)
+						params->identity.clear();
+					} else if (stateBackend == ZTS_STATE_BACKEND_FILES) {
+						std::string oldid;
+						OSUtils::readFile((params->path + ZT_PATH_SEPARATOR_S + "identity.secret").c_str(),oldid);
+						if (oldid.length()) {
+							OSUtils::writeFile((params->path + ZT_PATH_SEPARATOR_S + "identity.secret.saved_after_collision").c_str(),oldid);
+							OSUtils::rm((params->path + ZT_PATH_SEPARATOR_S + "identity.secret").c_str());
+							OSUtils::rm((params->path + ZT_PATH_SEPARATOR_S + "identity.public").c_str());
+						}
+					} else {
+						// Drop the identity so the restarted node generates a new one
+						StateBackend *b = StateBackend::create(stateBackend,params->path,stateGetCallback,statePutCallback,stateCallbackArg);
+						if (b) {
+							StateObjectKey k;
+							k.id[0] = 0;
+							k.id[1] = 0;
+							k.type = ZTS_STATE_OBJECT_IDENTITY_SECRET;
+							b->put(k,(const void *)0,-1);
+							k.type = ZTS_STATE_OBJECT_IDENTITY_PUBLIC;
+							b->put(k,(const void *)0,-1);
+							delete b;
+						}
 					}
 					_enqueueEvent(ZTS_EVENT_NODE_IDENTITY_COLLISION,NULL);
 				}	continue; // restart!
@@ -1299,9 +2737,13 @@ void *_runNodeService(void *arg)
 	} catch ( ... ) {
 		DEBUG_ERROR("unexpected exception starting ZeroTier instance");
 	}
+	{
+		std::lock_guard<std::mutex> l(serviceExitLock);
+		serviceExited.notify_all();
+	}
 	delete params;
-	zts_delay_ms(ZTS_CALLBACK_PROCESSING_INTERVAL*2);
-	_clrState(ZTS_STATE_CALLBACKS_RUNNING);
+	_stopCallbackThread();
+	_threadCount--;
 #ifndef __WINDOWS__
 	pthread_exit(0);
 #endif
@@ -22,10 +22,13 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
+#include <memory>
 
 #include "Node.hpp"
 #include "InetAddress.hpp"
 #include "Mutex.hpp"
+#include "Hashtable.hpp"
 #include "ZeroTierSockets.h"
 
 #define ZTS_SERVICE_THREAD_NAME           "ZTServiceThread"
@@ -37,6 +40,29 @@
 #define ZT_TAP_CHECK_MULTICAST_INTERVAL   5000
 // How often to check for local interface addresses
 #define ZT_LOCAL_INTERFACE_CHECK_INTERVAL 60000
+// How often the peer list is scanned for the peer snapshot and ZTS_EVENT_PEER_* transitions
+#define ZTS_PEER_CHECK_INTERVAL           1000
+// How often provisional networks are checked against the core, and how long the node
+// must have been online before one still running on its cached config counts as confirmed
+#define ZTS_PROVISIONAL_CHECK_INTERVAL    1000
+#define ZTS_PROVISIONAL_CONFIRM_TIMEOUT   15000
+// Paths heard from within this long before stop are saved as hints for the next start,
+// and at most this much of them is kept
+#define ZTS_PATH_HINT_MAX_AGE             600000
+#define ZTS_PATH_HINTS_MAX_SIZE           262144
+// How long ARP entries restored on start are held static before normal ARP takes over
+#define ZTS_NEIGHBOR_SEED_LIFETIME        60000
+#define ZTS_NEIGHBORS_MAX_SIZE            4096
+// Upper limit for the number of datagrams moved per recvmmsg()/sendmmsg() call
+#define ZTS_WIRE_BATCH_SIZE_MAX           64
+// Largest outbound datagram that is coalesced, anything bigger is sent immediately
+#define ZTS_WIRE_BATCH_SLOT_SIZE          2048
+// Segment and byte limits for one UDP_SEGMENT (GSO) send
+#define ZTS_GSO_MAX_SEGMENTS              64
+#define ZTS_GSO_MAX_BYTES                 65000
+// Receive slot size for UDP_GRO coalesced datagrams and slots read per recvmmsg()
+#define ZTS_GRO_SLOT_SIZE                 65536
+#define ZTS_GRO_BATCH_SIZE                16
 
 #ifdef __WINDOWS__
 #include <Windows.h>
@@ -53,6 +79,8 @@ public:
 
 	uint16_t _userProvidedPort;
 	std::string _userProvidedPath;
+	// Secret identity given to zts_start_with_identity(), used instead of a stored one and never written
+	std::string _userProvidedIdentity;
 
 	/**
 	 * Returned by node main if/when it terminates
@@ -172,7 +200,19 @@ public:
 	virtual void leaveAll() = 0;
 	virtual void join(uint64_t nwid) = 0;
 	virtual void leave(uint64_t nwid) = 0;
-	virtual int getPeerStatus(uint64_t id) = 0;
+
+	/**
+	 * Fills out a structure with the service's own counters
+	 */
+	virtual void getServiceStats(struct zts_stats_service *stats) = 0;
+
+	/**
+	 * Fetch the peer list and publish a new peer snapshot right away
+	 *
+	 * The service thread only scans peers while ZTS_EVENT_MASK_PEER is set,
+	 * otherwise peer queries call this when the snapshot is out of date.
+	 */
+	virtual void refreshPeerSnapshot() = 0;
 	
 	/**
 	 * Terminate background service (can be called from other threads)
@@ -201,10 +241,112 @@ private:
 	inline NodeService &operator=(const NodeService &one) { return *this; }
 };
 
+/**
+ * Number of threads currently run by libzt (service, callbacks, stack, workers, shards)
+ */
+extern std::atomic<uint32_t> _threadCount;
+
+/**
+ * Number of times those threads have woken up, to receive work or to poll
+ */
+extern std::atomic<uint64_t> _threadWakeups;
+
+/**
+ * Read-only copy of the node's peers, indexed by address
+ *
+ * The service thread builds a new one on each peer scan and publishes it
+ * with _setPeerSnapshot(). Readers keep the one returned by _getPeerSnapshot()
+ * for as long as they need it, so peer queries never wait on the service.
+ */
+struct PeerSnapshot
+{
+	/**
+	 * Whether the node was online when the snapshot was taken
+	 */
+	bool online;
+
+	/**
+	 * When the snapshot was taken (OSUtils::now())
+	 */
+	int64_t timestamp;
+
+	std::vector<struct zts_peer_details> peers;
+
+	/**
+	 * Position of each address in peers
+	 */
+	Hashtable<uint64_t,unsigned long> index;
+
+	/**
+	 * @return Peer with this address or NULL if it is not known
+	 */
+	inline const struct zts_peer_details *get(uint64_t address) const
+	{
+		const unsigned long *i = index.get(address);
+		return i ? &(peers[*i]) : (const struct zts_peer_details *)0;
+	}
+};
+
+/**
+ * @return Most recently published peer snapshot, empty if the service isn't running
+ */
+std::shared_ptr<const PeerSnapshot> _getPeerSnapshot();
+
+/**
+ * Replace the peer snapshot, readers still holding the previous one are unaffected
+ */
+void _setPeerSnapshot(const std::shared_ptr<const PeerSnapshot> &snapshot);
+
+/**
+ * Read-only copy of the joined networks' details, indexed by network ID
+ *
+ * Rebuilt and published by the service on every network config change,
+ * read the same way as PeerSnapshot.
+ */
+struct NetworkSnapshot
+{
+	struct Network
+	{
+		struct zts_network_details details;
+
+		/**
+		 * ZTS_STATE_NETWORK_* value
+		 */
+		int status;
+	};
+
+	std::vector<Network> networks;
+
+	/**
+	 * Position of each network ID in networks
+	 */
+	Hashtable<uint64_t,unsigned long> index;
+
+	/**
+	 * @return Network with this ID or NULL if it has not been joined
+	 */
+	inline const Network *get(uint64_t nwid) const
+	{
+		const unsigned long *i = index.get(nwid);
+		return i ? &(networks[*i]) : (const Network *)0;
+	}
+};
+
+/**
+ * @return Most recently published network snapshot, empty if the service isn't running
+ */
+std::shared_ptr<const NetworkSnapshot> _getNetworkSnapshot();
+
+/**
+ * Replace the network snapshot, readers still holding the previous one are unaffected
+ */
+void _setNetworkSnapshot(const std::shared_ptr<const NetworkSnapshot> &snapshot);
+
 struct serviceParameters
 {
 	int port;
 	std::string path;
+	std::string identity;
 };
 
 #ifdef __WINDOWS__
@@ -216,6 +358,11 @@ DWORD WINAPI _runNodeService(LPVOID arg);
 void *_runNodeService(void *arg);
 #endif
 
+/**
+ * Block until the NodeService thread has deleted the service and is about to exit
+ */
+void _waitForNodeServiceExit();
+
 } // namespace ZeroTier
 
 #endif
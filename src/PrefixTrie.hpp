@@ -0,0 +1,147 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Binary prefix trie for address/prefix containment checks
+ */
+
+#ifndef ZT_PREFIX_TRIE_HPP
+#define ZT_PREFIX_TRIE_HPP
+
+#include <stdint.h>
+#include <vector>
+
+#include "InetAddress.hpp"
+
+namespace ZeroTier {
+
+/**
+ * Set of IPv4 and IPv6 prefixes answering "is this address inside any of them"
+ *
+ * Built once and then only read, so any number of threads may call
+ * contains() on a trie nobody is adding to. A lookup visits at most one node
+ * per address bit no matter how many prefixes were added.
+ */
+class PrefixTrie
+{
+public:
+	PrefixTrie()
+	{
+		_root[0] = _newNode();
+		_root[1] = _newNode();
+	}
+
+	/**
+	 * Add the network of ip, its netmask bits (port field) give the prefix length
+	 */
+	inline void addNetwork(const InetAddress &ip)
+	{
+		add(ip,ip.netmaskBits());
+	}
+
+	/**
+	 * Add ip itself (a /32 or /128 prefix)
+	 */
+	inline void addAddress(const InetAddress &ip)
+	{
+		add(ip,(ip.ss_family == AF_INET6) ? 128 : 32);
+	}
+
+	/**
+	 * Add a prefix of ip, prefixes of 0 bits match every address of that family
+	 */
+	inline void add(const InetAddress &ip,unsigned int bits)
+	{
+		const int f = _family(ip);
+		if (f < 0)
+			return;
+		const unsigned int maxBits = f ? 128 : 32;
+		if (bits > maxBits)
+			bits = maxBits;
+		const uint8_t *a = reinterpret_cast<const uint8_t *>(ip.rawIpData());
+		uint32_t n = _root[f];
+		for(unsigned int i=0;i<bits;++i) {
+			if (_nodes[n].terminal)
+				return; // A shorter prefix already covers this one
+			const unsigned int b = (a[i >> 3] >> (7 - (i & 7))) & 1;
+			if (!_nodes[n].child[b]) {
+				const uint32_t c = _newNode();
+				_nodes[n].child[b] = c;
+			}
+			n = _nodes[n].child[b];
+		}
+		_nodes[n].terminal = true;
+	}
+
+	/**
+	 * @return True if addr lies inside any added prefix of the same family
+	 */
+	inline bool contains(const InetAddress &addr) const
+	{
+		const int f = _family(addr);
+		if (f < 0)
+			return false;
+		const unsigned int maxBits = f ? 128 : 32;
+		const uint8_t *a = reinterpret_cast<const uint8_t *>(addr.rawIpData());
+		uint32_t n = _root[f];
+		for(unsigned int i=0;;++i) {
+			if (_nodes[n].terminal)
+				return true;
+			if (i == maxBits)
+				return false;
+			n = _nodes[n].child[(a[i >> 3] >> (7 - (i & 7))) & 1];
+			if (!n)
+				return false;
+		}
+	}
+
+	/**
+	 * @return True if nothing has been added
+	 */
+	inline bool empty() const { return (_nodes.size() == 2); }
+
+private:
+	struct Node
+	{
+		uint32_t child[2]; // 0 means none, node 0 is a root and never a child
+		bool terminal;
+	};
+
+	static inline int _family(const InetAddress &ip)
+	{
+		if (ip.ss_family == AF_INET)
+			return 0;
+		if (ip.ss_family == AF_INET6)
+			return 1;
+		return -1;
+	}
+
+	inline uint32_t _newNode()
+	{
+		Node n;
+		n.child[0] = 0;
+		n.child[1] = 0;
+		n.terminal = false;
+		_nodes.push_back(n);
+		return (uint32_t)(_nodes.size() - 1);
+	}
+
+	std::vector<Node> _nodes;
+	uint32_t _root[2];
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -0,0 +1,624 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Storage backends for the node's state objects
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__WINDOWS__)
+#include <Windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#include "OSUtils.hpp"
+#include "Utils.hpp"
+
+#include "ZeroTierSockets.h"
+#include "StateBackend.hpp"
+
+namespace ZeroTier {
+
+StateBackend *StateBackend::create(int kind,const std::string &homePath,
+	int (*getFunc)(void *,int,const uint64_t *,void *,unsigned int),
+	int (*putFunc)(void *,int,const uint64_t *,const void *,int),
+	void *arg)
+{
+	switch(kind) {
+		case ZTS_STATE_BACKEND_FILES:
+			return new FileStateBackend(homePath);
+		case ZTS_STATE_BACKEND_MEMORY:
+			return new MemoryStateBackend();
+		case ZTS_STATE_BACKEND_LOG: {
+#if defined(__WINDOWS__)
+			// No mapped log here, keep one file per object
+			return new FileStateBackend(homePath);
+#else
+			LogStateBackend *b = new LogStateBackend(homePath);
+			if (b->open())
+				return b;
+			delete b;
+			return (StateBackend *)0;
+#endif
+		}
+		case ZTS_STATE_BACKEND_CALLBACKS:
+			if ((!getFunc)||(!putFunc))
+				return (StateBackend *)0;
+			return new CallbackStateBackend(getFunc,putFunc,arg);
+		default:
+			return (StateBackend *)0;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Files                                                                    //
+//////////////////////////////////////////////////////////////////////////////
+
+bool FileStateBackend::_path(const StateObjectKey &k,std::string &path,std::string &dir) const
+{
+	char p[1024];
+	dir.clear();
+	switch(k.type) {
+		case ZTS_STATE_OBJECT_IDENTITY_PUBLIC:
+			path = _homePath + ZT_PATH_SEPARATOR_S "identity.public";
+			return true;
+		case ZTS_STATE_OBJECT_IDENTITY_SECRET:
+			path = _homePath + ZT_PATH_SEPARATOR_S "identity.secret";
+			return true;
+		case ZTS_STATE_OBJECT_PLANET:
+			path = _homePath + ZT_PATH_SEPARATOR_S "planet";
+			return true;
+		case ZTS_STATE_OBJECT_NETWORK_CONFIG:
+			dir = _homePath + ZT_PATH_SEPARATOR_S "networks.d";
+			OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "%.16llx.conf",dir.c_str(),(unsigned long long)k.id[0]);
+			path = p;
+			return true;
+		case ZTS_STATE_OBJECT_PEER:
+			dir = _homePath + ZT_PATH_SEPARATOR_S "peers.d";
+			OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "%.10llx.peer",dir.c_str(),(unsigned long long)k.id[0]);
+			path = p;
+			return true;
+		case ZTS_STATE_OBJECT_PATH_HINTS:
+			path = _homePath + ZT_PATH_SEPARATOR_S "paths.hint";
+			return true;
+		case ZTS_STATE_OBJECT_NEIGHBORS:
+			dir = _homePath + ZT_PATH_SEPARATOR_S "networks.d";
+			OSUtils::ztsnprintf(p,sizeof(p),"%s" ZT_PATH_SEPARATOR_S "%.16llx.neighbors",dir.c_str(),(unsigned long long)k.id[0]);
+			path = p;
+			return true;
+		default:
+			return false;
+	}
+}
+
+int FileStateBackend::get(const StateObjectKey &k,void *data,unsigned int maxlen)
+{
+	std::string path,dir;
+	if (!_path(k,path,dir))
+		return -1;
+	FILE *f = fopen(path.c_str(),"rb");
+	if (!f)
+		return -1;
+	const int n = (int)fread(data,1,maxlen,f);
+	fclose(f);
+	return (n >= 0) ? n : -1;
+}
+
+bool FileStateBackend::put(const StateObjectKey &k,const void *data,int len)
+{
+	std::string path,dir;
+	if (!_path(k,path,dir))
+		return false;
+	if (len < 0) {
+		OSUtils::rm(path.c_str());
+		return true;
+	}
+
+	const std::string tmp(path + ".tmp");
+	FILE *f = fopen(tmp.c_str(),"wb");
+	if ((!f)&&(dir.length())) { // create subdirectory if it does not exist
+		OSUtils::mkdir(dir.c_str());
+		f = fopen(tmp.c_str(),"wb");
+	}
+	if (!f) {
+		fprintf(stderr,"WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S,path.c_str());
+		return false;
+	}
+	bool ok = ((len == 0)||(fwrite(data,(size_t)len,1,f) == 1));
+	ok &= (fflush(f) == 0);
+#if !defined(__WINDOWS__)
+	ok &= (fsync(fileno(f)) == 0);
+#endif
+	fclose(f);
+	if (ok) {
+		if ((k.type == ZTS_STATE_OBJECT_IDENTITY_SECRET)||(k.type == ZTS_STATE_OBJECT_NETWORK_CONFIG))
+			OSUtils::lockDownFile(tmp.c_str(),false);
+#if defined(__WINDOWS__)
+		ok = (MoveFileExA(tmp.c_str(),path.c_str(),MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+		ok = (::rename(tmp.c_str(),path.c_str()) == 0);
+#endif
+	}
+	if (!ok) {
+		OSUtils::rm(tmp.c_str());
+		fprintf(stderr,"WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S,path.c_str());
+	}
+	return ok;
+}
+
+void FileStateBackend::list(int type,std::vector<uint64_t> &ids)
+{
+	std::string dir,suffix;
+	std::size_t idLen;
+	if (type == ZTS_STATE_OBJECT_NETWORK_CONFIG) {
+		dir = _homePath + ZT_PATH_SEPARATOR_S "networks.d";
+		suffix = ".conf";
+		idLen = 16;
+	} else if (type == ZTS_STATE_OBJECT_PEER) {
+		dir = _homePath + ZT_PATH_SEPARATOR_S "peers.d";
+		suffix = ".peer";
+		idLen = 10;
+	} else {
+		return;
+	}
+	std::vector<std::string> files(OSUtils::listDirectory(dir.c_str()));
+	for(std::vector<std::string>::iterator f(files.begin());f!=files.end();++f) {
+		std::size_t dot = f->find_last_of('.');
+		if ((dot == idLen)&&(f->substr(idLen) == suffix))
+			ids.push_back(Utils::hexStrToU64(f->substr(0,dot).c_str()));
+	}
+}
+
+bool FileStateBackend::load(int type,std::map<StateObjectKey,std::string> &objects)
+{
+	std::vector<uint64_t> ids;
+	list(type,ids);
+	StateObjectKey k;
+	k.type = type;
+	k.id[1] = 0;
+	std::string path,dir;
+	for(std::vector<uint64_t>::iterator id(ids.begin());id!=ids.end();++id) {
+		k.id[0] = *id;
+		if ((_path(k,path,dir))&&(!OSUtils::readFile(path.c_str(),objects[k])))
+			objects.erase(k);
+	}
+	return true;
+}
+
+void FileStateBackend::expirePeers(int64_t olderThan)
+{
+	OSUtils::cleanDirectory((_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(),olderThan);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Memory                                                                   //
+//////////////////////////////////////////////////////////////////////////////
+
+std::mutex MemoryStateBackend::_m;
+std::map<StateObjectKey,MemoryStateBackend::Object> MemoryStateBackend::_objects;
+
+int MemoryStateBackend::get(const StateObjectKey &k,void *data,unsigned int maxlen)
+{
+	std::lock_guard<std::mutex> l(_m);
+	std::map<StateObjectKey,Object>::const_iterator o(_objects.find(k));
+	if (o == _objects.end())
+		return -1;
+	const int n = (int)((o->second.data.length() < maxlen) ? o->second.data.length() : maxlen);
+	memcpy(data,o->second.data.data(),(size_t)n);
+	return n;
+}
+
+bool MemoryStateBackend::put(const StateObjectKey &k,const void *data,int len)
+{
+	std::lock_guard<std::mutex> l(_m);
+	if (len < 0) {
+		_objects.erase(k);
+	} else {
+		Object &o = _objects[k];
+		o.data.assign(reinterpret_cast<const char *>(data),(size_t)len);
+		o.updated = OSUtils::now();
+	}
+	return true;
+}
+
+void MemoryStateBackend::list(int type,std::vector<uint64_t> &ids)
+{
+	std::lock_guard<std::mutex> l(_m);
+	for(std::map<StateObjectKey,Object>::const_iterator o(_objects.begin());o!=_objects.end();++o) {
+		if (o->first.type == type)
+			ids.push_back(o->first.id[0]);
+	}
+}
+
+void MemoryStateBackend::expirePeers(int64_t olderThan)
+{
+	std::lock_guard<std::mutex> l(_m);
+	for(std::map<StateObjectKey,Object>::iterator o(_objects.begin());o!=_objects.end();) {
+		if ((o->first.type == ZTS_STATE_OBJECT_PEER)&&(o->second.updated < olderThan))
+			_objects.erase(o++);
+		else ++o;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Log                                                                      //
+//////////////////////////////////////////////////////////////////////////////
+
+#if !defined(__WINDOWS__)
+
+// Length of a removal record
+#define ZTS_STATE_LOG_REMOVED 0xffffffffU
+
+namespace {
+
+// Precedes the data of every record, the data of a removal record is empty
+struct LogRecordHeader
+{
+	uint32_t len;   // ZTS_STATE_LOG_REMOVED for a removal
+	uint32_t type;
+	uint64_t id[2];
+	int64_t updated; // Time of the put, for expiring peers
+	uint64_t check;  // Of the other header fields and the data, catches torn appends
+};
+
+uint64_t _logRecordCheck(const LogRecordHeader &h,const void *data,unsigned int len)
+{
+	// FNV-1a
+	uint64_t c = 0xcbf29ce484222325ULL;
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(&h);
+	for(unsigned int i=0;i<(unsigned int)offsetof(LogRecordHeader,check);++i) {
+		c ^= p[i];
+		c *= 0x100000001b3ULL;
+	}
+	p = reinterpret_cast<const uint8_t *>(data);
+	for(unsigned int i=0;i<len;++i) {
+		c ^= p[i];
+		c *= 0x100000001b3ULL;
+	}
+	return c;
+}
+
+bool _writeAll(int fd,const void *data,size_t len)
+{
+	const char *p = reinterpret_cast<const char *>(data);
+	while (len) {
+		const ssize_t n = ::write(fd,p,len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+bool _readAll(int fd,void *data,size_t len,uint64_t offset)
+{
+	char *p = reinterpret_cast<char *>(data);
+	while (len) {
+		const ssize_t n = ::pread(fd,p,len,(off_t)offset);
+		if (n <= 0) {
+			if ((n < 0)&&(errno == EINTR))
+				continue;
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+		offset += (uint64_t)n;
+	}
+	return true;
+}
+
+} // anonymous namespace
+
+LogStateBackend::LogStateBackend(const std::string &homePath) :
+	_path(homePath + ZT_PATH_SEPARATOR_S ZTS_STATE_LOG_FILE),
+	_fd(-1),
+	_size(0),
+	_live(0),
+	_dirty(false)
+{
+}
+
+LogStateBackend::~LogStateBackend()
+{
+	if (_fd >= 0) {
+		sync();
+		::close(_fd);
+	}
+}
+
+bool LogStateBackend::open()
+{
+	std::lock_guard<std::mutex> l(_m);
+	_fd = ::open(_path.c_str(),O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC,0600);
+	if (_fd < 0) {
+		fprintf(stderr,"WARNING: unable to open state log: %s" ZT_EOL_S,_path.c_str());
+		return false;
+	}
+	struct stat st;
+	if (fstat(_fd,&st) != 0) {
+		::close(_fd);
+		_fd = -1;
+		return false;
+	}
+	const uint64_t size = (uint64_t)st.st_size;
+	uint64_t intact = 0;
+	if (size) {
+		void *p = mmap((void *)0,(size_t)size,PROT_READ,MAP_PRIVATE,_fd,0);
+		if (p == MAP_FAILED) {
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+		intact = _index(reinterpret_cast<const uint8_t *>(p),size);
+		munmap(p,(size_t)size);
+	}
+	if (intact < size) {
+		fprintf(stderr,"WARNING: dropping %llu bytes of torn records at the end of %s" ZT_EOL_S,(unsigned long long)(size - intact),_path.c_str());
+		if (ftruncate(_fd,(off_t)intact) != 0) {
+			::close(_fd);
+			_fd = -1;
+			return false;
+		}
+	}
+	_size = intact;
+	return true;
+}
+
+uint64_t LogStateBackend::_index(const uint8_t *p,uint64_t size)
+{
+	uint64_t o = 0;
+	while ((size - o) >= sizeof(LogRecordHeader)) {
+		LogRecordHeader h;
+		memcpy(&h,p + o,sizeof(h));
+		const uint64_t len = (h.len == ZTS_STATE_LOG_REMOVED) ? 0 : h.len;
+		if ((size - o - sizeof(h)) < len)
+			break;
+		if (_logRecordCheck(h,p + o + sizeof(h),(unsigned int)len) != h.check)
+			break;
+
+		StateObjectKey k;
+		k.type = (int)h.type;
+		k.id[0] = h.id[0];
+		k.id[1] = h.id[1];
+		std::map<StateObjectKey,Location>::iterator prev(_objects.find(k));
+		if (prev != _objects.end()) {
+			_live -= sizeof(LogRecordHeader) + prev->second.len;
+			if (h.len == ZTS_STATE_LOG_REMOVED)
+				_objects.erase(prev);
+		}
+		if (h.len != ZTS_STATE_LOG_REMOVED) {
+			Location &loc = _objects[k];
+			loc.offset = o + sizeof(h);
+			loc.len = h.len;
+			loc.updated = h.updated;
+			_live += sizeof(LogRecordHeader) + len;
+		}
+		o += sizeof(h) + len;
+	}
+	return o;
+}
+
+int LogStateBackend::get(const StateObjectKey &k,void *data,unsigned int maxlen)
+{
+	std::lock_guard<std::mutex> l(_m);
+	std::map<StateObjectKey,Location>::const_iterator loc(_objects.find(k));
+	if (loc == _objects.end())
+		return -1;
+	const unsigned int n = (loc->second.len < maxlen) ? loc->second.len : maxlen;
+	if (!_readAll(_fd,data,n,loc->second.offset))
+		return -1;
+	return (int)n;
+}
+
+bool LogStateBackend::put(const StateObjectKey &k,const void *data,int len)
+{
+	std::lock_guard<std::mutex> l(_m);
+	if ((len < 0)&&(_objects.find(k) == _objects.end()))
+		return true;
+	if (!_append(k,data,len))
+		return false;
+	_compactIfWasteful();
+	return true;
+}
+
+void LogStateBackend::_compactIfWasteful()
+{
+	const uint64_t garbage = _size - _live;
+	if ((garbage > ZTS_STATE_LOG_COMPACT_MIN_GARBAGE)&&(garbage > _live))
+		_compact(); // If this fails the log just stays bigger than it needs to be
+}
+
+bool LogStateBackend::_append(const StateObjectKey &k,const void *data,int len)
+{
+	LogRecordHeader h;
+	memset(&h,0,sizeof(h));
+	h.len = (len < 0) ? ZTS_STATE_LOG_REMOVED : (uint32_t)len;
+	h.type = (uint32_t)k.type;
+	h.id[0] = k.id[0];
+	h.id[1] = k.id[1];
+	h.updated = OSUtils::now();
+	const unsigned int dlen = (len < 0) ? 0 : (unsigned int)len;
+	h.check = _logRecordCheck(h,data,dlen);
+
+	std::string rec;
+	rec.reserve(sizeof(h) + dlen);
+	rec.append(reinterpret_cast<const char *>(&h),sizeof(h));
+	if (dlen)
+		rec.append(reinterpret_cast<const char *>(data),dlen);
+	if (!_writeAll(_fd,rec.data(),rec.length())) {
+		// Don't leave half a record for the next append to land behind
+		if (ftruncate(_fd,(off_t)_size) != 0) {}
+		fprintf(stderr,"WARNING: unable to append to state log: %s" ZT_EOL_S,_path.c_str());
+		return false;
+	}
+
+	std::map<StateObjectKey,Location>::iterator prev(_objects.find(k));
+	if (prev != _objects.end()) {
+		_live -= sizeof(LogRecordHeader) + prev->second.len;
+		if (len < 0)
+			_objects.erase(prev);
+	}
+	if (len >= 0) {
+		Location &loc = _objects[k];
+		loc.offset = _size + sizeof(h);
+		loc.len = dlen;
+		loc.updated = h.updated;
+		_live += sizeof(h) + dlen;
+	}
+	_size += rec.length();
+	_dirty = true;
+	return true;
+}
+
+bool LogStateBackend::_compact()
+{
+	const std::string tmp(_path + ".tmp");
+	const int fd = ::open(tmp.c_str(),O_RDWR|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC,0600);
+	if (fd < 0)
+		return false;
+
+	std::map<StateObjectKey,Location> objects;
+	std::string out,data;
+	uint64_t size = 0;
+	bool ok = true;
+	for(std::map<StateObjectKey,Location>::const_iterator o(_objects.begin());(ok)&&(o!=_objects.end());++o) {
+		data.resize(o->second.len);
+		if ((o->second.len)&&(!_readAll(_fd,&(data[0]),o->second.len,o->second.offset))) {
+			ok = false;
+			break;
+		}
+		LogRecordHeader h;
+		memset(&h,0,sizeof(h));
+		h.len = o->second.len;
+		h.type = (uint32_t)o->first.type;
+		h.id[0] = o->first.id[0];
+		h.id[1] = o->first.id[1];
+		h.updated = o->second.updated;
+		h.check = _logRecordCheck(h,data.data(),h.len);
+		out.append(reinterpret_cast<const char *>(&h),sizeof(h));
+		out.append(data);
+
+		Location &loc = objects[o->first];
+		loc.offset = size + sizeof(h);
+		loc.len = h.len;
+		loc.updated = h.updated;
+		size += sizeof(h) + h.len;
+
+		if (out.length() >= 65536) {
+			ok = _writeAll(fd,out.data(),out.length());
+			out.clear();
+		}
+	}
+	if (ok)
+		ok = ((_writeAll(fd,out.data(),out.length()))&&(fsync(fd) == 0)&&(::rename(tmp.c_str(),_path.c_str()) == 0));
+	if (!ok) {
+		::close(fd);
+		OSUtils::rm(tmp.c_str());
+		return false;
+	}
+
+	::close(_fd);
+	_fd = fd;
+	_objects.swap(objects);
+	_size = size;
+	_live = size;
+	_dirty = false;
+	return true;
+}
+
+void LogStateBackend::sync()
+{
+	std::lock_guard<std::mutex> l(_m);
+	if (_dirty) {
+		fsync(_fd);
+		_dirty = false;
+	}
+}
+
+void LogStateBackend::list(int type,std::vector<uint64_t> &ids)
+{
+	std::lock_guard<std::mutex> l(_m);
+	for(std::map<StateObjectKey,Location>::const_iterator o(_objects.begin());o!=_objects.end();++o) {
+		if (o->first.type == type)
+			ids.push_back(o->first.id[0]);
+	}
+}
+
+bool LogStateBackend::load(int type,std::map<StateObjectKey,std::string> &objects)
+{
+	std::lock_guard<std::mutex> l(_m);
+	if (!_size)
+		return true;
+	// One mapping for all of them instead of a read per object
+	void *p = mmap((void *)0,(size_t)_size,PROT_READ,MAP_SHARED,_fd,0);
+	if (p == MAP_FAILED)
+		return false;
+	for(std::map<StateObjectKey,Location>::const_iterator o(_objects.begin());o!=_objects.end();++o) {
+		if (o->first.type == type)
+			objects[o->first].assign(reinterpret_cast<const char *>(p) + o->second.offset,o->second.len);
+	}
+	munmap(p,(size_t)_size);
+	return true;
+}
+
+void LogStateBackend::expirePeers(int64_t olderThan)
+{
+	std::lock_guard<std::mutex> l(_m);
+	std::vector<StateObjectKey> expired;
+	for(std::map<StateObjectKey,Location>::const_iterator o(_objects.begin());o!=_objects.end();++o) {
+		if ((o->first.type == ZTS_STATE_OBJECT_PEER)&&(o->second.updated < olderThan))
+			expired.push_back(o->first);
+	}
+	if (expired.empty())
+		return;
+	// Removal records keep them from coming back on the next open, compaction then drops them all
+	for(std::vector<StateObjectKey>::const_iterator k(expired.begin());k!=expired.end();++k) {
+		if (!_append(*k,(const void *)0,-1))
+			break;
+	}
+	_compactIfWasteful();
+}
+
+#endif // !__WINDOWS__
+
+//////////////////////////////////////////////////////////////////////////////
+// Callbacks                                                                //
+//////////////////////////////////////////////////////////////////////////////
+
+int CallbackStateBackend::get(const StateObjectKey &k,void *data,unsigned int maxlen)
+{
+	const int n = _getFunc(_arg,k.type,k.id,data,maxlen);
+	return ((n >= 0)&&((unsigned int)n <= maxlen)) ? n : -1;
+}
+
+bool CallbackStateBackend::put(const StateObjectKey &k,const void *data,int len)
+{
+	return (_putFunc(_arg,k.type,k.id,(len >= 0) ? data : (const void *)0,len) == 0);
+}
+
+} // namespace ZeroTier
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Storage backends for the node's state objects
+ */
+
+#ifndef ZT_STATE_BACKEND_HPP
+#define ZT_STATE_BACKEND_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+// Name of the log backend's file in the home path
+#define ZTS_STATE_LOG_FILE "state.log"
+
+// The log is compacted once dead records take up more than this and more than the live ones
+#define ZTS_STATE_LOG_COMPACT_MIN_GARBAGE 65536
+
+namespace ZeroTier {
+
+/**
+ * Identifies a state object: a ZTS_STATE_OBJECT_* type and the ID the core gave it
+ */
+struct StateObjectKey
+{
+	int type;
+	uint64_t id[2];
+
+	inline bool operator<(const StateObjectKey &k) const
+	{
+		if (type != k.type)
+			return (type < k.type);
+		if (id[0] != k.id[0])
+			return (id[0] < k.id[0]);
+		return (id[1] < k.id[1]);
+	}
+};
+
+/**
+ * Where state objects are stored
+ *
+ * Puts come from the state cache's writer thread while the service thread may
+ * get and list at the same time, so implementations must be thread safe.
+ */
+class StateBackend
+{
+public:
+	virtual ~StateBackend() {}
+
+	/**
+	 * Read an object
+	 *
+	 * @return Length copied into data, or -1 if the object does not exist
+	 */
+	virtual int get(const StateObjectKey &k,void *data,unsigned int maxlen) = 0;
+
+	/**
+	 * Store an object
+	 *
+	 * @param len Length of data, or negative to remove the object
+	 * @return False if the object could not be stored
+	 */
+	virtual bool put(const StateObjectKey &k,const void *data,int len) = 0;
+
+	/**
+	 * Make everything put so far durable, called after each batch of puts
+	 */
+	virtual void sync() {}
+
+	/**
+	 * Get the first ID word of every stored object of a type (e.g. network IDs)
+	 */
+	virtual void list(int type,std::vector<uint64_t> &ids) {}
+
+	/**
+	 * Read every stored object of a type at once
+	 *
+	 * @return False if the backend can't enumerate its objects, or reading them one by one is just as cheap
+	 */
+	virtual bool load(int type,std::map<StateObjectKey,std::string> &objects) { return false; }
+
+	/**
+	 * Remove cached peers not updated since a given time, if the backend can tell
+	 *
+	 * @param olderThan Time in ms since epoch, as returned by OSUtils::now()
+	 */
+	virtual void expirePeers(int64_t olderThan) {}
+
+	/**
+	 * @return True if objects are kept in the home path as one file each
+	 */
+	virtual bool usesFiles() const { return false; }
+
+	/**
+	 * Create the backend selected with zts_set_state_backend()
+	 *
+	 * @param kind ZTS_STATE_BACKEND_* constant
+	 * @param homePath Home path for the file and log backends
+	 * @param getFunc Application's get function for the callback backend
+	 * @param putFunc Application's put function for the callback backend
+	 * @param arg Passed to getFunc and putFunc
+	 * @return Backend, or NULL if it could not be opened
+	 */
+	static StateBackend *create(int kind,const std::string &homePath,
+		int (*getFunc)(void *,int,const uint64_t *,void *,unsigned int),
+		int (*putFunc)(void *,int,const uint64_t *,const void *,int),
+		void *arg);
+};
+
+/**
+ * One file per object: identity.public, identity.secret, planet, paths.hint, networks.d/<nwid>.conf,
+ * networks.d/<nwid>.neighbors and peers.d/<address>.peer
+ *
+ * Files are replaced atomically (temporary file + rename) so a crash can't
+ * leave a truncated identity or network config behind.
+ */
+class FileStateBackend : public StateBackend
+{
+public:
+	FileStateBackend(const std::string &homePath) : _homePath(homePath) {}
+
+	virtual int get(const StateObjectKey &k,void *data,unsigned int maxlen);
+	virtual bool put(const StateObjectKey &k,const void *data,int len);
+	virtual void list(int type,std::vector<uint64_t> &ids);
+	virtual bool load(int type,std::map<StateObjectKey,std::string> &objects);
+	virtual void expirePeers(int64_t olderThan);
+	virtual bool usesFiles() const { return true; }
+
+private:
+	bool _path(const StateObjectKey &k,std::string &path,std::string &dir) const;
+
+	const std::string _homePath;
+};
+
+/**
+ * Objects only kept in memory, for hosts without persistent storage
+ *
+ * The objects outlive the node, so a node restarted within the same process
+ * keeps its identity.
+ */
+class MemoryStateBackend : public StateBackend
+{
+public:
+	virtual int get(const StateObjectKey &k,void *data,unsigned int maxlen);
+	virtual bool put(const StateObjectKey &k,const void *data,int len);
+	virtual void list(int type,std::vector<uint64_t> &ids);
+	virtual void expirePeers(int64_t olderThan);
+
+private:
+	struct Object
+	{
+		std::string data;
+		int64_t updated; // Time of the last put
+	};
+
+	static std::mutex _m;
+	static std::map<StateObjectKey,Object> _objects;
+};
+
+#if !defined(__WINDOWS__)
+/**
+ * All objects in one append-only file
+ *
+ * Every put appends a record, so a node with thousands of cached peers starts
+ * by reading a single file instead of opening thousands. The file is mapped
+ * and scanned once when opened to find the latest record of each object, a
+ * torn record at the end (crash during an append) is cut off. When dead
+ * records outweigh live ones the file is rewritten with only the live ones
+ * and renamed over the old one. Records carry the time of their put so
+ * peers can be expired without a file per peer to take the time from.
+ */
+class LogStateBackend : public StateBackend
+{
+public:
+	LogStateBackend(const std::string &homePath);
+	virtual ~LogStateBackend();
+
+	/**
+	 * Open the file and index its records
+	 *
+	 * @return False if the file could not be opened or created
+	 */
+	bool open();
+
+	virtual int get(const StateObjectKey &k,void *data,unsigned int maxlen);
+	virtual bool put(const StateObjectKey &k,const void *data,int len);
+	virtual void sync();
+	virtual void list(int type,std::vector<uint64_t> &ids);
+	virtual bool load(int type,std::map<StateObjectKey,std::string> &objects);
+	virtual void expirePeers(int64_t olderThan);
+
+private:
+	struct Location
+	{
+		uint64_t offset; // Of the data, past the record header
+		uint32_t len;
+		int64_t updated; // Time of the put that appended the record
+	};
+
+	bool _append(const StateObjectKey &k,const void *data,int len);
+	void _compactIfWasteful();
+	bool _compact();
+	uint64_t _index(const uint8_t *p,uint64_t size);
+
+	const std::string _path;
+	std::mutex _m;
+	int _fd;
+	uint64_t _size;
+	uint64_t _live;
+	bool _dirty;
+	std::map<StateObjectKey,Location> _objects;
+};
+#endif
+
+/**
+ * Objects handed to the application (see zts_set_state_callbacks())
+ */
+class CallbackStateBackend : public StateBackend
+{
+public:
+	typedef int (*GetFunction)(void *,int,const uint64_t *,void *,unsigned int);
+	typedef int (*PutFunction)(void *,int,const uint64_t *,const void *,int);
+
+	CallbackStateBackend(GetFunction getFunc,PutFunction putFunc,void *arg) :
+		_getFunc(getFunc),
+		_putFunc(putFunc),
+		_arg(arg) {}
+
+	virtual int get(const StateObjectKey &k,void *data,unsigned int maxlen);
+	virtual bool put(const StateObjectKey &k,const void *data,int len);
+
+private:
+	GetFunction _getFunc;
+	PutFunction _putFunc;
+	void *_arg;
+};
+
+} // namespace ZeroTier
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Write-behind cache for the node's state objects
+ */
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include "ZeroTierSockets.h"
+#include "StateCache.hpp"
+
+namespace ZeroTier {
+
+extern std::atomic<uint32_t> _threadCount;
+extern std::atomic<uint64_t> _threadWakeups;
+
+StateCache::StateCache() :
+	_backend((StateBackend *)0),
+	_running(false),
+	_stop(false),
+	_urgent(false),
+	_flushInterval(ZTS_STATE_FLUSH_INTERVAL_DEFAULT),
+	_loadedTypes(0)
+{
+}
+
+StateCache::~StateCache()
+{
+	stop();
+}
+
+void StateCache::start(StateBackend *backend,unsigned int flushInterval)
+{
+	std::lock_guard<std::mutex> l(_m);
+	if (_running)
+		return;
+	_backend = backend;
+	_flushInterval = flushInterval;
+	_stop = false;
+	_running = true;
+	_written.clear();
+	_thread = std::thread([this]() { _run(); });
+}
+
+void StateCache::stop()
+{
+	{
+		std::lock_guard<std::mutex> l(_m);
+		if (!_running)
+			return;
+		_stop = true;
+	}
+	_cv.notify_all();
+	_thread.join();
+	std::lock_guard<std::mutex> l(_m);
+	_running = false;
+	_backend = (StateBackend *)0;
+	_loaded.clear();
+	_loadedTypes = 0;
+}
+
+void StateCache::put(const StateObjectKey &k,const void *data,int len,bool urgent)
+{
+	const uint64_t h = (len >= 0) ? _hash(data,(unsigned int)len) : 0;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		if (!_backend)
+			return;
+		if ((len >= 0)&&(_pending.find(k) == _pending.end())) {
+			std::map<StateObjectKey,uint64_t>::const_iterator w(_written.find(k));
+			if ((w != _written.end())&&(w->second == h))
+				return; // Unchanged since it was last written
+		}
+		if (_loadedTypes & (1U << k.type)) {
+			if (len >= 0)
+				_loaded[k].assign(reinterpret_cast<const char *>(data),(size_t)len);
+			else _loaded.erase(k);
+		}
+		Entry &e = _pending[k];
+		if (len >= 0)
+			e.data.assign(reinterpret_cast<const char *>(data),(size_t)len);
+		else e.data.clear();
+		e.remove = (len < 0);
+		if (urgent)
+			_urgent = true;
+		_cv.notify_all();
+	}
+}
+
+int StateCache::get(const StateObjectKey &k,void *data,unsigned int maxlen)
+{
+	StateBackend *backend;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		const Entry *pe = (const Entry *)0;
+		std::map<StateObjectKey,Entry>::const_iterator e(_pending.find(k));
+		if (e != _pending.end()) {
+			pe = &(e->second);
+		} else {
+			e = _inFlight.find(k);
+			if (e != _inFlight.end())
+				pe = &(e->second);
+		}
+		if (pe) {
+			// Not written yet, or being written right now
+			if (pe->remove)
+				return -1;
+			const int len = (int)((pe->data.length() < maxlen) ? pe->data.length() : maxlen);
+			memcpy(data,pe->data.data(),(size_t)len);
+			return len;
+		}
+		if (_loadedTypes & (1U << k.type)) {
+			std::map<StateObjectKey,std::string>::const_iterator o(_loaded.find(k));
+			if (o == _loaded.end())
+				return -1;
+			const int len = (int)((o->second.length() < maxlen) ? o->second.length() : maxlen);
+			memcpy(data,o->second.data(),(size_t)len);
+			return len;
+		}
+		backend = _backend;
+	}
+	return (backend) ? backend->get(k,data,maxlen) : -1;
+}
+
+int StateCache::preload(int type)
+{
+	StateBackend *backend;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		backend = _backend;
+	}
+	std::map<StateObjectKey,std::string> objects;
+	if ((!backend)||(type < 0)||(type >= 32)||(!backend->load(type,objects)))
+		return -1;
+	std::lock_guard<std::mutex> l(_m);
+	for(std::map<StateObjectKey,std::string>::const_iterator o(objects.begin());o!=objects.end();++o) {
+		if ((_pending.find(o->first) == _pending.end())&&(_inFlight.find(o->first) == _inFlight.end()))
+			_written[o->first] = _hash(o->second.data(),(unsigned int)o->second.length());
+		_loaded[o->first] = o->second;
+	}
+	// Anything put but not written yet is newer than what was just loaded
+	_overlayUnwritten(_inFlight,type);
+	_overlayUnwritten(_pending,type);
+	_loadedTypes |= (1U << type);
+	return (int)objects.size();
+}
+
+void StateCache::_overlayUnwritten(const std::map<StateObjectKey,Entry> &entries,int type)
+{
+	for(std::map<StateObjectKey,Entry>::const_iterator e(entries.begin());e!=entries.end();++e) {
+		if (e->first.type != type)
+			continue;
+		if (e->second.remove)
+			_loaded.erase(e->first);
+		else _loaded[e->first] = e->second.data;
+	}
+}
+
+void StateCache::list(int type,std::vector<uint64_t> &ids)
+{
+	StateBackend *backend;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		if ((type >= 0)&&(type < 32)&&(_loadedTypes & (1U << type))) {
+			for(std::map<StateObjectKey,std::string>::const_iterator o(_loaded.begin());o!=_loaded.end();++o) {
+				if (o->first.type == type)
+					ids.push_back(o->first.id[0]);
+			}
+			return;
+		}
+		backend = _backend;
+	}
+	if (backend)
+		backend->list(type,ids);
+}
+
+void StateCache::expirePeers(int64_t olderThan)
+{
+	// No flush may write a peer between the listing below and the cleanup after it
+	std::lock_guard<std::mutex> fl(_flush_m);
+	StateBackend *backend;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		backend = _backend;
+	}
+	if (!backend)
+		return;
+	backend->expirePeers(olderThan);
+	std::vector<uint64_t> ids;
+	backend->list(ZTS_STATE_OBJECT_PEER,ids);
+	std::sort(ids.begin(),ids.end());
+
+	std::lock_guard<std::mutex> l(_m);
+	for(std::map<StateObjectKey,uint64_t>::iterator w(_written.begin());w!=_written.end();) {
+		if ((w->first.type == ZTS_STATE_OBJECT_PEER)&&(_pending.find(w->first) == _pending.end())&&(!std::binary_search(ids.begin(),ids.end(),w->first.id[0])))
+			_written.erase(w++);
+		else ++w;
+	}
+	for(std::map<StateObjectKey,std::string>::iterator o(_loaded.begin());o!=_loaded.end();) {
+		if ((o->first.type == ZTS_STATE_OBJECT_PEER)&&(_pending.find(o->first) == _pending.end())&&(!std::binary_search(ids.begin(),ids.end(),o->first.id[0])))
+			_loaded.erase(o++);
+		else ++o;
+	}
+}
+
+void StateCache::_run()
+{
+	_threadCount++;
+	std::unique_lock<std::mutex> l(_m);
+	for(;;) {
+		// Sleep until there is something to write, then give it the flush interval to coalesce
+		_cv.wait(l,[this]() { return ((_stop)||(!_pending.empty())); });
+		_cv.wait_for(l,std::chrono::milliseconds(_flushInterval),[this]() { return ((_stop)||(_urgent)); });
+		_threadWakeups++;
+		_urgent = false;
+		l.unlock();
+		_flush();
+		l.lock();
+		if ((_stop)&&(_pending.empty()))
+			break;
+	}
+	_threadCount--;
+}
+
+void StateCache::_flush()
+{
+	std::lock_guard<std::mutex> fl(_flush_m);
+	std::map<StateObjectKey,bool> known;
+	{
+		std::lock_guard<std::mutex> l(_m);
+		_inFlight.swap(_pending);
+		// Record the new contents right away so a put() racing with the write below
+		// compares against them and not against what is about to be replaced
+		for(std::map<StateObjectKey,Entry>::const_iterator e(_inFlight.begin());e!=_inFlight.end();++e) {
+			std::map<StateObjectKey,uint64_t>::iterator w(_written.find(e->first));
+			known[e->first] = (w != _written.end());
+			if (e->second.remove) {
+				if (w != _written.end())
+					_written.erase(w);
+			} else {
+				_written[e->first] = _hash(e->second.data.data(),(unsigned int)e->second.data.length());
+			}
+		}
+	}
+	// Only this thread changes _inFlight while _flush_m is held, so it is read here without _m
+	for(std::map<StateObjectKey,Entry>::const_iterator e(_inFlight.begin());e!=_inFlight.end();++e) {
+		if (!_write(e->first,e->second,known[e->first])) {
+			// Make sure the next put() for this object isn't skipped
+			std::lock_guard<std::mutex> l(_m);
+			_written.erase(e->first);
+		}
+	}
+	if (!_inFlight.empty())
+		_backend->sync();
+	std::lock_guard<std::mutex> l(_m);
+	_inFlight.clear();
+}
+
+bool StateCache::_write(const StateObjectKey &k,const Entry &e,bool known)
+{
+	if (e.remove)
+		return _backend->put(k,(const void *)0,-1);
+	if (!known) {
+		// First time this object is seen, skip the write if it already holds these contents
+		std::string existing(e.data.length() + 1,'\0');
+		if (_backend->get(k,&(existing[0]),(unsigned int)existing.length()) == (int)e.data.length()) {
+			existing.resize(e.data.length());
+			if (existing == e.data)
+				return true;
+		}
+	}
+	return _backend->put(k,e.data.data(),(int)e.data.length());
+}
+
+uint64_t StateCache::_hash(const void *data,unsigned int len)
+{
+	// FNV-1a, seeded with the length
+	uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)len;
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+	for(unsigned int i=0;i<len;++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+} // namespace ZeroTier
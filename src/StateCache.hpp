@@ -0,0 +1,147 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * Write-behind cache for the node's state objects
+ */
+
+#ifndef ZT_STATE_CACHE_HPP
+#define ZT_STATE_CACHE_HPP
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "StateBackend.hpp"
+
+// Default time state updates are held (and coalesced) before being written, in milliseconds
+#define ZTS_STATE_FLUSH_INTERVAL_DEFAULT 5000
+
+namespace ZeroTier {
+
+/**
+ * Remembers what was last written to each state object and writes updates from its own thread
+ *
+ * put() only records the new contents, a writer thread picks them up after
+ * the flush interval so repeated updates of the same object (e.g. a peer) end
+ * up as a single write to the backend. Contents equal to what was last written
+ * are not written again.
+ */
+class StateCache
+{
+public:
+	StateCache();
+	~StateCache();
+
+	/**
+	 * Start the writer thread
+	 *
+	 * @param backend Where objects are written, must outlive stop()
+	 * @param flushInterval How long updates are held before being written, in milliseconds
+	 */
+	void start(StateBackend *backend,unsigned int flushInterval);
+
+	/**
+	 * Write everything still pending and stop the writer thread
+	 */
+	void stop();
+
+	/**
+	 * Queue new contents for an object
+	 *
+	 * @param k Object to replace
+	 * @param data New contents
+	 * @param len Length of data, or negative to remove the object
+	 * @param urgent Write without waiting for the flush interval
+	 */
+	void put(const StateObjectKey &k,const void *data,int len,bool urgent);
+
+	/**
+	 * Read an object, including contents which have not been written yet
+	 *
+	 * @return Length copied into data, or -1 if the object does not exist
+	 */
+	int get(const StateObjectKey &k,void *data,unsigned int maxlen);
+
+	/**
+	 * Read all objects of a type from the backend into memory
+	 *
+	 * Gets of that type are then answered from memory, including those for
+	 * objects which don't exist, and the first put of each loaded object is
+	 * compared against what was loaded instead of reading it back.
+	 *
+	 * @return Number of objects loaded, or -1 if the backend can't load them at once
+	 */
+	int preload(int type);
+
+	/**
+	 * Get the first ID word of every object of a type
+	 */
+	void list(int type,std::vector<uint64_t> &ids);
+
+	/**
+	 * Expire cached peers in the backend and forget the ones it dropped
+	 *
+	 * Without this a preloaded peer would still be served from memory, and a
+	 * peer coming back with the contents it had would not be written again.
+	 *
+	 * @param olderThan Passed to StateBackend::expirePeers()
+	 */
+	void expirePeers(int64_t olderThan);
+
+private:
+	struct Entry
+	{
+		std::string data;
+		bool remove;
+	};
+
+	void _run();
+	void _flush();
+	bool _write(const StateObjectKey &k,const Entry &e,bool known);
+	void _overlayUnwritten(const std::map<StateObjectKey,Entry> &entries,int type);
+	static uint64_t _hash(const void *data,unsigned int len);
+
+	StateBackend *_backend;
+	std::thread _thread;
+	std::mutex _m;
+	std::condition_variable _cv;
+	bool _running;
+	bool _stop;
+	bool _urgent;
+	unsigned int _flushInterval;
+
+	// Latest contents of each object not written yet
+	std::map<StateObjectKey,Entry> _pending;
+
+	// Contents taken from _pending by _flush(), still served by get() until written
+	std::map<StateObjectKey,Entry> _inFlight;
+	std::mutex _flush_m; // Held across a whole _flush(), taken before _m
+
+	// Hash of what each object was last written with (or found to contain)
+	std::map<StateObjectKey,uint64_t> _written;
+
+	// Current contents of every object of the preloaded types
+	std::map<StateObjectKey,std::string> _loaded;
+	uint32_t _loadedTypes; // Bit (1 << type) set for each preloaded type
+};
+
+} // namespace ZeroTier
+
+#endif
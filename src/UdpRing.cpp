@@ -0,0 +1,280 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * io_uring backend for UDP sockets owned by the node service
+ */
+
+#ifdef ZTS_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "UdpRing.hpp"
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Kind of operation, stored in the upper half of each request's user data
+#define ZTS_UDP_RING_OP_RECV 1ULL
+#define ZTS_UDP_RING_OP_SEND 2ULL
+#define ZTS_UDP_RING_OP_STOP 3ULL
+
+namespace ZeroTier {
+
+UdpRing::UdpRing() :
+	_ready(false),
+	_stopFd(-1),
+	_bufRing((struct io_uring_buf_ring *)0),
+	_bufs((uint8_t *)0),
+	_bufCount(0),
+	_bufSize(0),
+	_bufsReturned(0),
+	_sendSlots((SendSlot *)0),
+	_pendingSends(0)
+{
+	memset(&_ring,0,sizeof(_ring));
+	memset(&_recvMsg,0,sizeof(_recvMsg));
+}
+
+UdpRing::~UdpRing()
+{
+	if (_ready || _bufRing) {
+		if (_bufRing)
+			io_uring_free_buf_ring(&_ring,_bufRing,_bufCount,ZTS_UDP_RING_BUFFER_GROUP);
+		io_uring_queue_exit(&_ring);
+	}
+	delete [] _bufs;
+	delete [] _sendSlots;
+}
+
+bool UdpRing::init(const int *fds,unsigned int nfds,int stopFd,unsigned int bufCount,unsigned int bufSize)
+{
+	if (io_uring_queue_init(ZTS_UDP_RING_ENTRIES,&_ring,0) < 0)
+		return false;
+	int ret = 0;
+	_bufRing = io_uring_setup_buf_ring(&_ring,bufCount,ZTS_UDP_RING_BUFFER_GROUP,0,&ret);
+	if (!_bufRing) {
+		io_uring_queue_exit(&_ring);
+		return false;
+	}
+
+	// Each buffer holds the recvmsg header, source address and control data ahead of the payload
+	_recvMsg.msg_namelen = sizeof(struct sockaddr_storage);
+	_recvMsg.msg_controllen = CMSG_SPACE(sizeof(int));
+	_bufCount = bufCount;
+	_bufSize = sizeof(struct io_uring_recvmsg_out) + _recvMsg.msg_namelen + _recvMsg.msg_controllen + bufSize;
+	_bufs = new uint8_t[_bufCount * _bufSize];
+	for(unsigned int i=0;i<_bufCount;++i)
+		_recycleBuffer(i);
+	io_uring_buf_ring_advance(_bufRing,_bufsReturned);
+	_bufsReturned = 0;
+
+	for(unsigned int i=0;i<nfds;++i) {
+		if (fds[i] >= 0)
+			_fds.push_back(fds[i]);
+	}
+	_rearm.resize(_fds.size(),false);
+	_stopFd = stopFd;
+
+	_sendSlots = new SendSlot[ZTS_UDP_RING_SEND_SLOTS];
+	for(unsigned int i=0;i<ZTS_UDP_RING_SEND_SLOTS;++i)
+		_freeSendSlots.push_back(i);
+
+	_ready = true;
+	return true;
+}
+
+bool UdpRing::run(DatagramHandler handler,void (*afterBatch)(void *),void *arg)
+{
+	if (!_ready)
+		return false;
+	{
+		Mutex::Lock _l(_sq_m);
+		for(unsigned int i=0;i<_fds.size();++i)
+			_armRecv(i);
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+		if (!sqe)
+			return false;
+		io_uring_prep_poll_add(sqe,_stopFd,POLLIN);
+		io_uring_sqe_set_data64(sqe,ZTS_UDP_RING_OP_STOP << 32);
+		io_uring_submit(&_ring);
+	}
+
+	bool running = true;
+	bool unsupported = false;
+	while (running) {
+		struct io_uring_cqe *cqe;
+		const int r = io_uring_wait_cqe(&_ring,&cqe);
+		if (r == -EINTR)
+			continue;
+		if (r < 0)
+			break;
+
+		unsigned int head;
+		unsigned int seen = 0;
+		io_uring_for_each_cqe(&_ring,head,cqe) {
+			++seen;
+			const uint64_t op = io_uring_cqe_get_data64(cqe) >> 32;
+			const unsigned int idx = (unsigned int)(io_uring_cqe_get_data64(cqe) & 0xffffffffULL);
+			if (op == ZTS_UDP_RING_OP_STOP) {
+				running = false;
+				continue;
+			}
+			if (op == ZTS_UDP_RING_OP_SEND) {
+				Mutex::Lock _l(_sq_m);
+				_freeSendSlots.push_back(idx);
+				continue;
+			}
+
+			// Multishot receive, re-armed below once the kernel ends it (e.g. ran out of buffers)
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				_rearm[idx] = true;
+			if ((cqe->res == -EINVAL)||(cqe->res == -EOPNOTSUPP)) {
+				// Kernel lacks multishot recvmsg, let the caller fall back
+				unsupported = true;
+				running = false;
+				continue;
+			}
+			if ((cqe->res < 0)||(!(cqe->flags & IORING_CQE_F_BUFFER)))
+				continue;
+
+			const unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			uint8_t *buf = _bufs + ((size_t)bid * _bufSize);
+			struct io_uring_recvmsg_out *o = io_uring_recvmsg_validate(buf,cqe->res,&_recvMsg);
+			if ((o)&&(!(o->flags & MSG_TRUNC))&&(o->namelen <= sizeof(struct sockaddr_storage))) {
+				struct sockaddr_storage from;
+				memset(&from,0,sizeof(from));
+				memcpy(&from,io_uring_recvmsg_name(o),o->namelen);
+				const void *payload = io_uring_recvmsg_payload(o,&_recvMsg);
+				const unsigned int len = io_uring_recvmsg_payload_length(o,cqe->res,&_recvMsg);
+				unsigned int segSize = len;
+				for(struct cmsghdr *cm=io_uring_recvmsg_cmsg_firsthdr(o,&_recvMsg);cm;cm=io_uring_recvmsg_cmsg_nexthdr(o,&_recvMsg,cm)) {
+					if ((cm->cmsg_level == IPPROTO_UDP)&&(cm->cmsg_type == UDP_GRO)) {
+						int gso = 0;
+						memcpy(&gso,CMSG_DATA(cm),sizeof(gso));
+						if (gso > 0)
+							segSize = (unsigned int)gso;
+					}
+				}
+				if ((len)&&(!handler(arg,_fds[idx],&from,payload,len,segSize)))
+					running = false;
+			}
+			_recycleBuffer(bid);
+		}
+		io_uring_cq_advance(&_ring,seen);
+		if (_bufsReturned) {
+			io_uring_buf_ring_advance(_bufRing,_bufsReturned);
+			_bufsReturned = 0;
+		}
+
+		if (running) {
+			Mutex::Lock _l(_sq_m);
+			bool armed = false;
+			for(unsigned int i=0;i<_rearm.size();++i) {
+				if ((_rearm[i])&&(_armRecv(i))) {
+					_rearm[i] = false;
+					armed = true;
+				}
+			}
+			if (armed)
+				io_uring_submit(&_ring);
+		}
+		if (afterBatch)
+			afterBatch(arg);
+	}
+	if (unsupported) {
+		// Nothing reaps send completions from here on, so stop taking sends
+		// (and their slots) and push out the ones already queued
+		Mutex::Lock _l(_sq_m);
+		_ready = false;
+		if (_pendingSends) {
+			io_uring_submit(&_ring);
+			_pendingSends = 0;
+		}
+	}
+	return !unsupported;
+}
+
+bool UdpRing::send(int fd,const struct sockaddr_storage *addr,const void *data,unsigned int len)
+{
+	if ((!_ready)||(len > ZTS_UDP_RING_SEND_SLOT_SIZE))
+		return false;
+	Mutex::Lock _l(_sq_m);
+	if ((!_ready)||(_freeSendSlots.empty()))
+		return false;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+	if (!sqe) {
+		// Submission queue is full, push what we have and try once more
+		io_uring_submit(&_ring);
+		_pendingSends = 0;
+		sqe = io_uring_get_sqe(&_ring);
+		if (!sqe)
+			return false;
+	}
+	const unsigned int idx = _freeSendSlots.back();
+	_freeSendSlots.pop_back();
+	SendSlot &s = _sendSlots[idx];
+	memcpy(s.data,data,len);
+	memcpy(&(s.addr),addr,sizeof(struct sockaddr_storage));
+	s.iov.iov_base = s.data;
+	s.iov.iov_len = len;
+	memset(&(s.msg),0,sizeof(s.msg));
+	s.msg.msg_name = &(s.addr);
+	s.msg.msg_namelen = (addr->ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	s.msg.msg_iov = &(s.iov);
+	s.msg.msg_iovlen = 1;
+	io_uring_prep_sendmsg(sqe,fd,&(s.msg),0);
+	io_uring_sqe_set_data64(sqe,(ZTS_UDP_RING_OP_SEND << 32) | idx);
+	++_pendingSends;
+	return true;
+}
+
+void UdpRing::flush()
+{
+	if (!_ready)
+		return;
+	Mutex::Lock _l(_sq_m);
+	if (_pendingSends) {
+		io_uring_submit(&_ring);
+		_pendingSends = 0;
+	}
+}
+
+// Caller must hold _sq_m
+bool UdpRing::_armRecv(unsigned int i)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+	if (!sqe)
+		return false;
+	io_uring_prep_recvmsg_multishot(sqe,_fds[i],&_recvMsg,0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ZTS_UDP_RING_BUFFER_GROUP;
+	io_uring_sqe_set_data64(sqe,(ZTS_UDP_RING_OP_RECV << 32) | i);
+	return true;
+}
+
+void UdpRing::_recycleBuffer(unsigned int bid)
+{
+	io_uring_buf_ring_add(_bufRing,_bufs + ((size_t)bid * _bufSize),_bufSize,bid,io_uring_buf_ring_mask(_bufCount),_bufsReturned++);
+}
+
+} // namespace ZeroTier
+
+#endif // ZTS_IO_URING
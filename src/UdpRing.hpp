@@ -0,0 +1,143 @@
+/*
+ * Copyright (c)2013-2020 ZeroTier, Inc.
+ *
+ * Use of this software is governed by the Business Source License included
+ * in the LICENSE.TXT file in the project's root directory.
+ *
+ * Change Date: 2024-01-01
+ *
+ * On the date above, in accordance with the Business Source License, use
+ * of this software will be governed by version 2.0 of the Apache License.
+ */
+/****/
+
+/**
+ * @file
+ *
+ * io_uring backend for UDP sockets owned by the node service
+ */
+
+#ifndef ZT_UDP_RING_HPP
+#define ZT_UDP_RING_HPP
+
+#ifdef ZTS_IO_URING
+
+#include <sys/socket.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include <liburing.h>
+
+#include "Mutex.hpp"
+
+// Number of submission queue entries
+#define ZTS_UDP_RING_ENTRIES       1024
+// Buffer group ID used for provided receive buffers
+#define ZTS_UDP_RING_BUFFER_GROUP  7
+// Number of outbound datagram slots
+#define ZTS_UDP_RING_SEND_SLOTS    512
+// Largest datagram sent through the ring, anything bigger must be sent directly
+#define ZTS_UDP_RING_SEND_SLOT_SIZE 2048
+
+namespace ZeroTier {
+
+/**
+ * Receives and sends datagrams on a small set of UDP sockets via io_uring
+ *
+ * Receives use one multishot recvmsg per socket drawing from a ring of
+ * provided (kernel registered) buffers, so no system call is made per datagram.
+ * Sends are copied into a fixed slot pool and submitted together by flush().
+ * run() is meant to be called by exactly one thread, send() and flush() may be
+ * called from any thread.
+ */
+class UdpRing
+{
+public:
+	/**
+	 * Called by run() for each received datagram
+	 *
+	 * @param arg Argument given to run()
+	 * @param fd Socket the datagram arrived on
+	 * @param from Source address
+	 * @param data Datagram payload
+	 * @param len Payload length
+	 * @param segSize Size of the coalesced datagrams if UDP_GRO merged several (else len)
+	 */
+	typedef bool (*DatagramHandler)(void *arg,int fd,const struct sockaddr_storage *from,const void *data,unsigned int len,unsigned int segSize);
+
+	UdpRing();
+	~UdpRing();
+
+	/**
+	 * Set up the ring, the provided receive buffers and the send slots
+	 *
+	 * @param fds Sockets to receive on (invalid descriptors are skipped)
+	 * @param nfds Number of entries in fds
+	 * @param stopFd run() returns once this descriptor becomes readable
+	 * @param bufCount Number of receive buffers (power of two)
+	 * @param bufSize Largest datagram to receive
+	 * @return False if io_uring (or a required feature) is unavailable
+	 */
+	bool init(const int *fds,unsigned int nfds,int stopFd,unsigned int bufCount,unsigned int bufSize);
+
+	/**
+	 * Process completions until stopFd is readable or the handler returns false
+	 *
+	 * @param handler Called for each received datagram, returning false stops the loop
+	 * @param afterBatch Called after each batch of completions
+	 * @param arg Passed to handler and afterBatch
+	 * @return False if the kernel does not support multishot receives (caller should fall back),
+	 * the ring then no longer accepts sends since nothing would reap their completions
+	 */
+	bool run(DatagramHandler handler,void (*afterBatch)(void *),void *arg);
+
+	/**
+	 * Queue a datagram, it is submitted with the next flush()
+	 *
+	 * @return False if the datagram does not fit or no send slot is free
+	 */
+	bool send(int fd,const struct sockaddr_storage *addr,const void *data,unsigned int len);
+
+	/**
+	 * Submit all queued sends with a single system call
+	 */
+	void flush();
+
+private:
+	struct SendSlot
+	{
+		struct msghdr msg;
+		struct iovec iov;
+		struct sockaddr_storage addr;
+		uint8_t data[ZTS_UDP_RING_SEND_SLOT_SIZE];
+	};
+
+	bool _armRecv(unsigned int i);
+	void _recycleBuffer(unsigned int bid);
+
+	std::atomic<bool> _ready; // Cleared if run() finds multishot receives unsupported
+	struct io_uring _ring;
+	Mutex _sq_m; // submission queue, send slot free list and _pendingSends
+
+	std::vector<int> _fds;
+	std::vector<bool> _rearm;
+	int _stopFd;
+	struct msghdr _recvMsg;
+
+	struct io_uring_buf_ring *_bufRing;
+	uint8_t *_bufs;
+	unsigned int _bufCount;
+	unsigned int _bufSize;
+	unsigned int _bufsReturned;
+
+	SendSlot *_sendSlots;
+	std::vector<unsigned int> _freeSendSlots;
+	unsigned int _pendingSends;
+};
+
+} // namespace ZeroTier
+
+#endif // ZTS_IO_URING
+
+#endif
@@ -17,6 +17,8 @@
  * Virtual ethernet tap device and combined network stack driver
  */
 
+#include <algorithm>
+
 #include "MAC.hpp"
 #include "Mutex.hpp"
 #include "InetAddress.hpp"
@@ -43,12 +45,23 @@
 #include "Synchapi.h"
 #endif
 
-#define ZTS_TAP_THREAD_POLLING_INTERVAL 50
-#define LWIP_DRIVER_LOOP_INTERVAL       250
+
+// Wrap incoming frames in recycled custom pbufs instead of allocating a new
+// pbuf (chain) for each frame. Frames too large for a pooled buffer still
+// take the pbuf_alloc() path.
+#define ZTS_LWIP_RX_CUSTOM_PBUF         1
+// Size of each pooled receive buffer (ethernet header + frame)
+#define ZTS_RX_PBUF_BUF_SIZE            (ZT_DEFAULT_MTU + 32)
+// Maximum number of idle receive buffers kept around for reuse
+#define ZTS_RX_PBUF_POOL_MAX            512
 
 namespace ZeroTier {
 
-extern void _enqueueEvent(int16_t eventCode, void *arg = NULL);
+extern std::atomic<uint32_t> _threadCount;
+extern std::atomic<uint64_t> _threadWakeups;
+
+// Maximum number of inbound frames delivered to the stack per core lock hold
+unsigned int rxBatchMaxSize = ZTS_RX_BATCH_SIZE_DEFAULT;
 
 /**
  * A virtual tap device. The ZeroTier core service creates one of these for each
@@ -63,48 +76,44 @@ VirtualTap::VirtualTap(
 	const char *friendlyName,
 	void (*handler)(void *,void*,uint64_t,const MAC &,const MAC &,
 		unsigned int,unsigned int,const void *,unsigned int),
+	void (*txNotify)(void *),
 	void *arg) :
 		_handler(handler),
+		_txNotify(txNotify),
+		_txPending(false),
 		_homePath(homePath),
 		_arg(arg),
 		_initialized(false),
 		_enabled(true),
-		_run(true),
 		_mac(mac),
 		_mtu(mtu),
-		_nwid(nwid),
-		_unixListenSocket((PhySocket *)0),
-		_phy(this,false,true)
+		_nwid(nwid)
 {
 	memset(vtap_full_name, 0, sizeof(vtap_full_name));
 	snprintf(vtap_full_name, sizeof(vtap_full_name), "libzt%llx", (unsigned long long)_nwid);
 	_dev = vtap_full_name;
-#ifndef __WINDOWS__
-	::pipe(_shutdownSignalPipe);
-#endif
-	// Start virtual tap thread and stack I/O loops
-	_thread = Thread::start(this);
 }
 
 VirtualTap::~VirtualTap()
 {
-	struct zts_network_details *nd = new zts_network_details;
-	nd->nwid = _nwid;
-	_enqueueEvent(ZTS_EVENT_NETWORK_DOWN, (void*)nd);
-	_run = false;
-#ifndef __WINDOWS__
-	::write(_shutdownSignalPipe[1],"\0",1);
-#endif
-	_phy.whack();
+	struct zts_network_details nd;
+	memset(&nd, 0, sizeof(nd));
+	nd.nwid = _nwid;
+	_enqueueEvent(ZTS_EVENT_NETWORK_DOWN, &nd);
+	flushRx();
 	_lwip_remove_netif(netif4);
 	netif4 = NULL;
 	_lwip_remove_netif(netif6);
 	netif6 = NULL;
-	Thread::join(_thread);
-#ifndef __WINDOWS__
-	::close(_shutdownSignalPipe[0]);
-	::close(_shutdownSignalPipe[1]);
-#endif
+	// The stack can no longer queue frames, release whatever was not sent
+	std::vector<struct pbuf *> unsent;
+	if (dequeueTx(unsent)) {
+		LOCK_TCPIP_CORE();
+		for (std::vector<struct pbuf *>::iterator p(unsent.begin());p!=unsent.end();++p) {
+			pbuf_free(*p);
+		}
+		UNLOCK_TCPIP_CORE();
+	}
 }
 
 void VirtualTap::lastConfigUpdate(uint64_t lastConfigUpdateTime)
@@ -173,17 +182,18 @@ bool VirtualTap::addIp(const InetAddress &ip)
 		// TODO: Add ZTS_EVENT_ADDR_NEW ?
 		_ips.push_back(ip);
 		// Send callback message
-		struct zts_addr_details *ad = new zts_addr_details;
-		ad->nwid = _nwid;
+		struct zts_addr_details ad;
+		memset(&ad, 0, sizeof(ad));
+		ad.nwid = _nwid;
 		if (ip.isV4()) {
-			struct sockaddr_in *in4 = (struct sockaddr_in*)&(ad->addr);
+			struct sockaddr_in *in4 = (struct sockaddr_in*)&(ad.addr);
 			memcpy(&(in4->sin_addr.s_addr), ip.rawIpData(), 4);
-			_enqueueEvent(ZTS_EVENT_ADDR_ADDED_IP4, (void*)ad);
+			_enqueueEvent(ZTS_EVENT_ADDR_ADDED_IP4, &ad);
 		}
 		if (ip.isV6()) {
-			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&(ad->addr);
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&(ad.addr);
 			memcpy(&(in6->sin6_addr.s6_addr), ip.rawIpData(), 16);
-			_enqueueEvent(ZTS_EVENT_ADDR_ADDED_IP6, (void*)ad);
+			_enqueueEvent(ZTS_EVENT_ADDR_ADDED_IP6, &ad);
 		}
 		std::sort(_ips.begin(),_ips.end());
 	}
@@ -195,19 +205,20 @@ bool VirtualTap::removeIp(const InetAddress &ip)
 	Mutex::Lock _l(_ips_m);
 	std::vector<InetAddress>::iterator i(std::find(_ips.begin(),_ips.end(),ip));
 	if (std::find(_ips.begin(),_ips.end(),ip) != _ips.end()) {
-		struct zts_addr_details *ad = new zts_addr_details;
-		ad->nwid = _nwid;
+		struct zts_addr_details ad;
+		memset(&ad, 0, sizeof(ad));
+		ad.nwid = _nwid;
 		if (ip.isV4()) {
-			struct sockaddr_in *in4 = (struct sockaddr_in*)&(ad->addr);
+			struct sockaddr_in *in4 = (struct sockaddr_in*)&(ad.addr);
 			memcpy(&(in4->sin_addr.s_addr), ip.rawIpData(), 4);
-			_enqueueEvent(ZTS_EVENT_ADDR_REMOVED_IP4, (void*)ad);
+			_enqueueEvent(ZTS_EVENT_ADDR_REMOVED_IP4, &ad);
 			// FIXME: De-register from network stack
 		}
 		if (ip.isV6()) {
 			// FIXME: De-register from network stack
-			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&(ad->addr);
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&(ad.addr);
 			memcpy(&(in6->sin6_addr.s6_addr), ip.rawIpData(), 16);
-			_enqueueEvent(ZTS_EVENT_ADDR_REMOVED_IP6, (void*)ad);
+			_enqueueEvent(ZTS_EVENT_ADDR_REMOVED_IP6, &ad);
 		}
 		_ips.erase(i);
 	}
@@ -224,10 +235,52 @@ void VirtualTap::put(const MAC &from,const MAC &to,unsigned int etherType,
 	const void *data,unsigned int len)
 {
 	if (len <= _mtu && _enabled) {
-		LOCK_TCPIP_CORE();
-		_lwip_eth_rx(this, from, to, etherType, data, len);
-		UNLOCK_TCPIP_CORE();
+		struct pbuf *p = _lwip_eth_rx(this, from, to, etherType, data, len);
+		if (!p) {
+			return;
+		}
+		bool full = false;
+		{
+			Mutex::Lock _l(_rxBatch_m);
+			_rxBatch.push_back(p);
+			full = _rxBatch.size() >= rxBatchMaxSize;
+		}
+		if (full) {
+			flushRx();
+		}
+	}
+}
+
+void VirtualTap::flushRx()
+{
+	std::vector<struct pbuf *> batch;
+	{
+		Mutex::Lock _l(_rxBatch_m);
+		if (_rxBatch.empty()) {
+			return;
+		}
+		batch.swap(_rxBatch);
+	}
+	// The batch is detached first so that put() never waits on the core lock
+	LOCK_TCPIP_CORE();
+	for (std::vector<struct pbuf *>::iterator p(batch.begin());p!=batch.end();++p) {
+		_lwip_eth_input(this, *p);
+	}
+	UNLOCK_TCPIP_CORE();
+}
+
+size_t VirtualTap::dequeueTx(std::vector<struct pbuf *> &batch)
+{
+	// Clear first so that a frame queued while draining triggers another notification
+	_txPending = false;
+	size_t total = 0;
+	struct pbuf *bulk[64];
+	size_t count;
+	while ((count = _txQueue.try_dequeue_bulk(bulk, 64)) > 0) {
+		batch.insert(batch.end(), bulk, bulk + count);
+		total += count;
 	}
+	return total;
 }
 
 std::string VirtualTap::deviceName() const
@@ -274,55 +327,21 @@ void VirtualTap::setMtu(unsigned int mtu)
 	_mtu = mtu;
 }
 
-void VirtualTap::threadMain()
-	throw()
-{
-	fd_set readfds,nullfds;
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
-	FD_ZERO(&readfds);
-	FD_ZERO(&nullfds);
-	int nfds = (int)std::max(_shutdownSignalPipe[0],0) + 1;
-#if defined(__linux__)
-	pthread_setname_np(pthread_self(), vtap_full_name);
-#endif
-#if defined(__APPLE__)
-	pthread_setname_np(vtap_full_name);
-#endif
-	while (true) {
-		FD_SET(_shutdownSignalPipe[0],&readfds);
-		select(nfds,&readfds,&nullfds,&nullfds,&tv);
-		// writes to shutdown pipe terminate thread
-		if (FD_ISSET(_shutdownSignalPipe[0],&readfds)) {
-			break;
-		}
-#if defined(__WINDOWS__)
-		Sleep(ZTS_TAP_THREAD_POLLING_INTERVAL);
-#else
-		struct timespec sleepValue = {0};
-		sleepValue.tv_nsec = ZTS_TAP_THREAD_POLLING_INTERVAL * 500000;
-		nanosleep(&sleepValue, NULL);
-#endif
-	}
-}
-
-void VirtualTap::phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *local_address,
-	const struct sockaddr *from,void *data,unsigned long len) {}
-void VirtualTap::phyOnTcpConnect(PhySocket *sock,void **uptr,bool success) {}
-void VirtualTap::phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,
-	const struct sockaddr *from) {}
-void VirtualTap::phyOnTcpClose(PhySocket *sock,void **uptr) {}
-void VirtualTap::phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len) {}
-void VirtualTap::phyOnTcpWritable(PhySocket *sock,void **uptr) {}
-void VirtualTap::phyOnUnixClose(PhySocket *sock,void **uptr) {}
-
 //////////////////////////////////////////////////////////////////////////////
 // Netif driver code for lwIP network stack                                 //
 //////////////////////////////////////////////////////////////////////////////
 
 bool _has_exited = false;
 
+// Whether the driver thread was started, and the semaphores used to stop it
+// (signalled by _lwip_driver_shutdown()) and to report that it has exited
+bool _has_started = false;
+sys_sem_t _driverStopSem;
+sys_sem_t _driverExitSem;
+
+// lwIP can't stop its tcpip thread, so a restarted driver thread reuses it
+static bool _tcpip_started = false;
+
 // Used to generate enumerated lwIP interface names
 int netifCount = 0;
 
@@ -334,6 +353,8 @@ static void _tcpip_init_done(void *arg)
 {
 	sys_sem_t *sem;
 	sem = (sys_sem_t *)arg;
+	// Runs on the tcpip thread, which lwIP never stops
+	_threadCount++;
 	_setState(ZTS_STATE_STACK_RUNNING);
 	_enqueueEvent(ZTS_EVENT_STACK_UP);
 	sys_sem_signal(sem);
@@ -347,19 +368,29 @@ static void _main_lwip_driver_loop(void *arg)
 #if defined(__APPLE__)
 	pthread_setname_np(ZTS_LWIP_DRIVER_THREAD_NAME);
 #endif
-	sys_sem_t sem;
+	_threadCount++;
 	LWIP_UNUSED_ARG(arg);
-	if (sys_sem_new(&sem, 0) != ERR_OK) {
-		DEBUG_ERROR("failed to create semaphore");
-	}
-	tcpip_init(_tcpip_init_done, &sem);
-	sys_sem_wait(&sem);
-	// Main loop
-	while(_getState(ZTS_STATE_STACK_RUNNING)) {
-		zts_delay_ms(LWIP_DRIVER_LOOP_INTERVAL);
-	}
+	if (!_tcpip_started) {
+		sys_sem_t sem;
+		if (sys_sem_new(&sem, 0) != ERR_OK) {
+			DEBUG_ERROR("failed to create semaphore");
+		}
+		tcpip_init(_tcpip_init_done, &sem);
+		sys_sem_wait(&sem);
+		sys_sem_free(&sem);
+		_tcpip_started = true;
+	}
+	else {
+		_setState(ZTS_STATE_STACK_RUNNING);
+		_enqueueEvent(ZTS_EVENT_STACK_UP);
+	}
+	// Sleep until _lwip_driver_shutdown() asks us to stop
+	sys_sem_wait(&_driverStopSem);
+	_threadWakeups++;
+	_threadCount--;
 	_has_exited = true;
 	_enqueueEvent(ZTS_EVENT_STACK_DOWN);
+	sys_sem_signal(&_driverExitSem);
 }
 
 bool _lwip_is_up()
@@ -368,38 +399,44 @@ bool _lwip_is_up()
 	return _getState(ZTS_STATE_STACK_RUNNING);
 }
 
-bool _lwip_has_previously_shutdown()
-{
-	Mutex::Lock _l(stackLock);
-	return _has_exited;
-}
-
 void _lwip_driver_init()
 {
 	if (_lwip_is_up()) {
 		return;
 	}
-	if (_lwip_has_previously_shutdown()) {
+	Mutex::Lock _l(stackLock);
+	if (_has_started) {
 		return;
 	}
-	Mutex::Lock _l(stackLock);
 #if defined(__WINDOWS__)
 	sys_init(); // Required for win32 init of critical sections
 #endif
+	if ((sys_sem_new(&_driverStopSem, 0) != ERR_OK)
+		|| (sys_sem_new(&_driverExitSem, 0) != ERR_OK)) {
+		DEBUG_ERROR("failed to create semaphore");
+		return;
+	}
+	_has_exited = false;
+	_has_started = true;
 	sys_thread_new(ZTS_LWIP_DRIVER_THREAD_NAME, _main_lwip_driver_loop,
 		NULL, DEFAULT_THREAD_STACKSIZE, DEFAULT_THREAD_PRIO);
 }
 
 void _lwip_driver_shutdown()
 {
-	if (_lwip_has_previously_shutdown()) {
+	Mutex::Lock _l(stackLock);
+	if (!_has_started) {
 		return;
 	}
-	Mutex::Lock _l(stackLock);
 	// Set flag to stop sending frames into the core
 	_clrState(ZTS_STATE_STACK_RUNNING);
-	// Wait until the main lwIP thread has exited
-	while (!_has_exited) { zts_delay_ms(LWIP_DRIVER_LOOP_INTERVAL); }
+	// Wake the main lwIP thread and wait until it has exited
+	sys_sem_signal(&_driverStopSem);
+	sys_sem_wait(&_driverExitSem);
+	sys_sem_free(&_driverStopSem);
+	sys_sem_free(&_driverExitSem);
+	// zts_start() may start it again
+	_has_started = false;
 	/*
 	if (tcpip_shutdown() == ERR_OK) {
 		sys_timeouts_free();
@@ -420,63 +457,197 @@ void _lwip_remove_netif(void *netif)
 	UNLOCK_TCPIP_CORE();
 }
 
+/**
+ * Whether any segment of a frame points at memory the stack does not own,
+ * such as the application buffer lwip_sendto() wraps in a PBUF_REF. That
+ * memory may be reused as soon as the call that produced the frame returns.
+ */
+static bool _lwip_pbuf_is_borrowed(struct pbuf *p)
+{
+	for (struct pbuf *q = p; q; q = q->next) {
+		// Our pooled receive pbufs are PBUF_REF too, but own their buffers
+		if ((q->type_internal == PBUF_REF || q->type_internal == PBUF_ROM)
+			&& !(q->flags & PBUF_FLAG_IS_CUSTOM)) {
+			return true;
+		}
+		if (q->len == q->tot_len) {
+			break;
+		}
+	}
+	return false;
+}
+
 err_t _lwip_eth_tx(struct netif *n, struct pbuf *p)
 {
 	if (!n) {
 		return ERR_IF;
 	}
-	struct pbuf *q;
-	char buf[ZT_MAX_MTU+32];
-	char *bufptr;
-	int totalLength = 0;
-
 	VirtualTap *tap = (VirtualTap*)n->state;
-	bufptr = buf;
-	for (q = p; q != NULL; q = q->next) {
-		memcpy(bufptr, q->payload, q->len);
-		bufptr += q->len;
-		totalLength += q->len;
-	}
-	struct eth_hdr *ethhdr;
-	ethhdr = (struct eth_hdr *)buf;
-
-	MAC src_mac;
-	MAC dest_mac;
-	src_mac.setTo(ethhdr->src.addr, 6);
-	dest_mac.setTo(ethhdr->dest.addr, 6);
-
-	char *data = buf + sizeof(struct eth_hdr);
-	int len = totalLength - sizeof(struct eth_hdr);
-	int proto = Utils::ntoh((uint16_t)ethhdr->type);
-	tap->_handler(tap->_arg, NULL, tap->_nwid, src_mac, dest_mac, proto, 0, data, len);
-	if (ZT_MSG_TRANSFER == true) {
-		char flagbuf[32];
-		memset(&flagbuf, 0, 32);
-		char macBuf[ZTS_MAC_ADDRSTRLEN], nodeBuf[16];
-		snprintf(macBuf, ZTS_MAC_ADDRSTRLEN, "%02x:%02x:%02x:%02x:%02x:%02x",
-			ethhdr->dest.addr[0], ethhdr->dest.addr[1], ethhdr->dest.addr[2],
-			ethhdr->dest.addr[3], ethhdr->dest.addr[4], ethhdr->dest.addr[5]);
-		MAC mac;
-		mac.setTo(ethhdr->dest.addr, 6);
-		mac.toAddress(tap->_nwid).toString(nodeBuf);
-		/*
-		DEBUG_TRANS("len=%5d dst=%s [%s TX <-- %s] ethertype=0x%04x %s", totalLength, macBuf, nodeBuf, tap->nodeId().c_str(),
-			Utils::ntoh(ethhdr->type), flagbuf);
-		*/
+	if (_lwip_pbuf_is_borrowed(p)) {
+		// Sent later by the service thread, so take a copy of borrowed memory
+		p = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+		if (!p) {
+			return ERR_MEM;
+		}
+	}
+	else {
+		// Hold a reference instead of copying, the stack does not modify or
+		// reuse memory it owns while we hold it (see tcp_output_segment_busy())
+		pbuf_ref(p);
+	}
+	if (!tap->_txQueue.enqueue(p)) {
+		pbuf_free(p);
+		return ERR_MEM;
+	}
+	if (!tap->_txPending.exchange(true) && tap->_txNotify) {
+		tap->_txNotify(tap->_arg);
 	}
 	return ERR_OK;
 }
 
-void _lwip_eth_rx(VirtualTap *tap, const MAC &from, const MAC &to, unsigned int etherType,
-	const void *data, unsigned int len)
+void _lwip_eth_tx_submit(void (*handler)(void *, void *, uint64_t, const MAC &, const MAC &,
+	unsigned int, unsigned int, const void *, unsigned int), void *arg,
+	std::vector<uint64_t> &nwids, std::vector<struct pbuf *> &batch)
 {
-#ifdef LWIP_STATS
-	stats_display();
+	char buf[ZT_MAX_MTU+32];
+	for (size_t i = 0; i < batch.size(); i++) {
+		struct pbuf *p = batch[i];
+		char *frame;
+		int totalLength;
+		if (p->len == p->tot_len) {
+			// Contiguous frame, pass the pbuf payload straight through
+			frame = (char *)p->payload;
+			totalLength = p->len;
+		}
+		else {
+			// Chained frame, the core only accepts flat buffers
+			frame = buf;
+			totalLength = pbuf_copy_partial(p, buf, sizeof(buf), 0);
+		}
+		if (totalLength < (int)sizeof(struct eth_hdr)) {
+			continue;
+		}
+		struct eth_hdr *ethhdr;
+		ethhdr = (struct eth_hdr *)frame;
+
+		MAC src_mac;
+		MAC dest_mac;
+		src_mac.setTo(ethhdr->src.addr, 6);
+		dest_mac.setTo(ethhdr->dest.addr, 6);
+
+		char *data = frame + sizeof(struct eth_hdr);
+		int len = totalLength - sizeof(struct eth_hdr);
+		int proto = Utils::ntoh((uint16_t)ethhdr->type);
+		handler(arg, NULL, nwids[i], src_mac, dest_mac, proto, 0, data, len);
+		if (ZT_MSG_TRANSFER == true) {
+			char flagbuf[32];
+			memset(&flagbuf, 0, 32);
+			char macBuf[ZTS_MAC_ADDRSTRLEN], nodeBuf[16];
+			snprintf(macBuf, ZTS_MAC_ADDRSTRLEN, "%02x:%02x:%02x:%02x:%02x:%02x",
+				ethhdr->dest.addr[0], ethhdr->dest.addr[1], ethhdr->dest.addr[2],
+				ethhdr->dest.addr[3], ethhdr->dest.addr[4], ethhdr->dest.addr[5]);
+			MAC mac;
+			mac.setTo(ethhdr->dest.addr, 6);
+			mac.toAddress(nwids[i]).toString(nodeBuf);
+			/*
+			DEBUG_TRANS("len=%5d dst=%s [%s TX <-- %s] ethertype=0x%04x %s", totalLength, macBuf, nodeBuf, tap->nodeId().c_str(),
+				Utils::ntoh(ethhdr->type), flagbuf);
+			*/
+		}
+	}
+	// Give all references back to the stack at once
+	LOCK_TCPIP_CORE();
+	for (size_t i = 0; i < batch.size(); i++) {
+		pbuf_free(batch[i]);
+	}
+	UNLOCK_TCPIP_CORE();
+	batch.clear();
+	nwids.clear();
+}
+
+#if ZTS_LWIP_RX_CUSTOM_PBUF
+/**
+ * Receive buffer handed to the stack as a custom pbuf. Returned to
+ * _rxPbufPool by lwIP (via _lwip_rx_pbuf_free) once the stack is done with it.
+ */
+struct zts_rx_pbuf
+{
+	struct pbuf_custom p; // Must be first
+	uint8_t buf[ZTS_RX_PBUF_BUF_SIZE];
+};
+
+// Idle receive buffers shared by all taps
+moodycamel::ConcurrentQueue<struct zts_rx_pbuf*> _rxPbufPool;
+
+static void _lwip_rx_pbuf_free(struct pbuf *p)
+{
+	// Called by whichever thread drops the last reference (stack or application)
+	struct zts_rx_pbuf *rp = (struct zts_rx_pbuf*)p;
+	if (_rxPbufPool.size_approx() >= ZTS_RX_PBUF_POOL_MAX || !_rxPbufPool.enqueue(rp)) {
+		delete rp;
+	}
+}
+
+static struct pbuf *_lwip_rx_pbuf_alloc(uint16_t len)
+{
+	struct zts_rx_pbuf *rp = NULL;
+	if (!_rxPbufPool.try_dequeue(rp)) {
+		rp = new zts_rx_pbuf;
+	}
+	rp->p.custom_free_function = _lwip_rx_pbuf_free;
+	return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &(rp->p), rp->buf, sizeof(rp->buf));
+}
 #endif
+
+/**
+ * Build a single frame (synthesized ethernet header + payload) for the stack
+ */
+static struct pbuf *_lwip_frame_to_pbuf(const struct eth_hdr *ethhdr, const void *data,
+	unsigned int len)
+{
+	struct pbuf *p,*q;
+#if ZTS_LWIP_RX_CUSTOM_PBUF
+	if ((len + sizeof(struct eth_hdr)) <= ZTS_RX_PBUF_BUF_SIZE) {
+		p = _lwip_rx_pbuf_alloc((uint16_t)len+sizeof(struct eth_hdr));
+		if (p) {
+			memcpy(p->payload, ethhdr, sizeof(struct eth_hdr));
+			memcpy((char*)p->payload + sizeof(struct eth_hdr), data, len);
+			return p;
+		}
+	}
+#endif
+	p = pbuf_alloc(PBUF_RAW, (uint16_t)len+sizeof(struct eth_hdr), PBUF_RAM);
+	if (!p) {
+		DEBUG_ERROR("dropped packet: unable to allocate memory for pbuf");
+		return NULL;
+	}
+	// First pbuf gets ethernet header at start
+	q = p;
+	if (q->len < sizeof(struct eth_hdr)) {
+		pbuf_free(p);
+		DEBUG_ERROR("dropped packet: first pbuf smaller than ethernet header");
+		return NULL;
+	}
+	// Copy frame data into pbuf
+	const char *dataptr = reinterpret_cast<const char *>(data);
+	memcpy(q->payload,ethhdr,sizeof(struct eth_hdr));
+	int remainingPayloadSpace = q->len - sizeof(struct eth_hdr);
+	memcpy((char*)q->payload + sizeof(struct eth_hdr),dataptr,remainingPayloadSpace);
+	dataptr += remainingPayloadSpace;
+	// Remaining pbufs (if any) get rest of data
+	while ((q = q->next)) {
+		memcpy(q->payload,dataptr,q->len);
+		dataptr += q->len;
+	}
+	return p;
+}
+
+struct pbuf *_lwip_eth_rx(VirtualTap *tap, const MAC &from, const MAC &to,
+	unsigned int etherType, const void *data, unsigned int len)
+{
 	if (!_getState(ZTS_STATE_STACK_RUNNING)) {
-		return;
+		return NULL;
 	}
-	struct pbuf *p,*q;
 	struct eth_hdr ethhdr;
 	from.copyTo(ethhdr.src.addr, 6);
 	to.copyTo(ethhdr.dest.addr, 6);
@@ -497,47 +668,36 @@ void _lwip_eth_rx(VirtualTap *tap, const MAC &from, const MAC &to, unsigned int
 			Utils::ntoh(ethhdr.type), flagbuf);
 		*/
 	}
+	return _lwip_frame_to_pbuf(&ethhdr, data, len);
+}
 
-	p = pbuf_alloc(PBUF_RAW, (uint16_t)len+sizeof(struct eth_hdr), PBUF_RAM);
-	if (!p) {
-		DEBUG_ERROR("dropped packet: unable to allocate memory for pbuf");
-		return;
-	}
-	// First pbuf gets ethernet header at start
-	q = p;
-	if (q->len < sizeof(ethhdr)) {
+void _lwip_eth_input(VirtualTap *tap, struct pbuf *p)
+{
+#ifdef LWIP_STATS
+	stats_display();
+#endif
+	if (!_getState(ZTS_STATE_STACK_RUNNING)) {
 		pbuf_free(p);
-		p = NULL;
-		DEBUG_ERROR("dropped packet: first pbuf smaller than ethernet header");
 		return;
 	}
-	// Copy frame data into pbuf
-	const char *dataptr = reinterpret_cast<const char *>(data);
-	memcpy(q->payload,&ethhdr,sizeof(ethhdr));
-	int remainingPayloadSpace = q->len - sizeof(ethhdr);
-	memcpy((char*)q->payload + sizeof(ethhdr),dataptr,remainingPayloadSpace);
-	dataptr += remainingPayloadSpace;
-	// Remaining pbufs (if any) get rest of data
-	while ((q = q->next)) {
-		memcpy(q->payload,dataptr,q->len);
-		dataptr += q->len;
-	}
 	// Feed packet into stack
 	int err;
-
-	if(tap->netif4)
-	if (Utils::ntoh(ethhdr.type) == 0x800 || Utils::ntoh(ethhdr.type) == 0x806) {
-		if ((err = ((struct netif *)tap->netif4)->input(p, (struct netif *)tap->netif4)) != ERR_OK) {
-			DEBUG_ERROR("packet input error (%d)", err);
-			pbuf_free(p);
-		}
+	struct netif *n = NULL;
+	uint16_t etherType = Utils::ntoh((uint16_t)((struct eth_hdr *)p->payload)->type);
+	if (etherType == 0x800 || etherType == 0x806) {
+		n = (struct netif *)tap->netif4;
 	}
-	if(tap->netif6)
-	if (Utils::ntoh(ethhdr.type) == 0x86DD) {
-		if ((err = ((struct netif *)tap->netif6)->input(p, (struct netif *)tap->netif6)) != ERR_OK) {
-			DEBUG_ERROR("packet input error (%d)", err);
-			pbuf_free(p);
-		}
+	if (etherType == 0x86DD) {
+		n = (struct netif *)tap->netif6;
+	}
+	if (!n) {
+		// No interface to accept this frame, give the buffer back
+		pbuf_free(p);
+		return;
+	}
+	if ((err = n->input(p, n)) != ERR_OK) {
+		DEBUG_ERROR("packet input error (%d)", err);
+		pbuf_free(p);
 	}
 }
 
@@ -574,6 +734,50 @@ bool _lwip_is_netif_up(void *n)
 	return result;
 }
 
+void _lwip_get_arp_entries(void *n, std::vector<std::pair<InetAddress,MAC> > &entries)
+{
+	if (!n) {
+		return;
+	}
+	ip4_addr_t *ip;
+	struct netif *netif;
+	struct eth_addr *eth;
+	LOCK_TCPIP_CORE();
+	for (size_t i = 0; i < ARP_TABLE_SIZE; i++) {
+		if (etharp_get_entry(i, &ip, &netif, &eth) && (netif == (struct netif*)n)) {
+			entries.push_back(std::pair<InetAddress,MAC>(InetAddress(&(ip->addr), 4, 0), MAC(eth->addr, 6)));
+		}
+	}
+	UNLOCK_TCPIP_CORE();
+}
+
+bool _lwip_add_static_arp_entry(const InetAddress &ip, const MAC &mac)
+{
+	if (!ip.isV4()) {
+		return false;
+	}
+	ip4_addr_t ip4;
+	struct eth_addr eth;
+	ip4.addr = *((u32_t *)ip.rawIpData());
+	mac.copyTo(eth.addr, 6);
+	LOCK_TCPIP_CORE();
+	err_t err = etharp_add_static_entry(&ip4, &eth);
+	UNLOCK_TCPIP_CORE();
+	return (err == ERR_OK);
+}
+
+void _lwip_remove_static_arp_entry(const InetAddress &ip)
+{
+	if (!ip.isV4()) {
+		return;
+	}
+	ip4_addr_t ip4;
+	ip4.addr = *((u32_t *)ip.rawIpData());
+	LOCK_TCPIP_CORE();
+	etharp_remove_static_entry(&ip4);
+	UNLOCK_TCPIP_CORE();
+}
+
 /**
  * Called when a netif is removed (ZTS_EVENT_NETIF_INTERFACE_REMOVED)
  */
@@ -587,11 +791,12 @@ static void _netif_remove_callback(struct netif *n)
 	VirtualTap *tap = (VirtualTap *)n->state;
 	uint64_t mac = 0;
 	memcpy(&mac, n->hwaddr, n->hwaddr_len);
-	struct zts_netif_details *ifd = new zts_netif_details;
-	ifd->nwid = tap->_nwid;
-	memcpy(&(ifd->mac), n->hwaddr, n->hwaddr_len);
-	ifd->mac = lwip_htonl(ifd->mac) >> 16;
-	_enqueueEvent(ZTS_EVENT_NETIF_REMOVED, (void*)ifd);
+	struct zts_netif_details ifd;
+	memset(&ifd, 0, sizeof(ifd));
+	ifd.nwid = tap->_nwid;
+	memcpy(&(ifd.mac), n->hwaddr, n->hwaddr_len);
+	ifd.mac = lwip_htonl(ifd.mac) >> 16;
+	_enqueueEvent(ZTS_EVENT_NETIF_REMOVED, &ifd);
 }
 #endif
 
@@ -608,19 +813,16 @@ static void _netif_link_callback(struct netif *n)
 	VirtualTap *tap = (VirtualTap *)n->state;
 	uint64_t mac = 0;
 	memcpy(&mac, n->hwaddr, n->hwaddr_len);
+	struct zts_netif_details ifd;
+	memset(&ifd, 0, sizeof(ifd));
+	ifd.nwid = tap->_nwid;
+	memcpy(&(ifd.mac), n->hwaddr, n->hwaddr_len);
+	ifd.mac = lwip_htonl(ifd.mac) >> 16;
 	if (n->flags & NETIF_FLAG_LINK_UP) {
-		struct zts_netif_details *ifd = new zts_netif_details;
-		ifd->nwid = tap->_nwid;
-		memcpy(&(ifd->mac), n->hwaddr, n->hwaddr_len);
-		ifd->mac = lwip_htonl(ifd->mac) >> 16;
-		_enqueueEvent(ZTS_EVENT_NETIF_LINK_UP, (void*)ifd);
+		_enqueueEvent(ZTS_EVENT_NETIF_LINK_UP, &ifd);
 	}
 	if (n->flags & NETIF_FLAG_LINK_UP) {
-		struct zts_netif_details *ifd = new zts_netif_details;
-		ifd->nwid = tap->_nwid;
-		memcpy(&(ifd->mac), n->hwaddr, n->hwaddr_len);
-		ifd->mac = lwip_htonl(ifd->mac) >> 16;
-		_enqueueEvent(ZTS_EVENT_NETIF_LINK_DOWN, (void*)ifd);
+		_enqueueEvent(ZTS_EVENT_NETIF_LINK_DOWN, &ifd);
 	}
 }
 #endif
@@ -642,18 +844,20 @@ void _lwip_set_callbacks(struct netif *n)
 #endif
 }
 
-static struct zts_netif_details *_lwip_prepare_netif_status_msg(struct netif *n)
+static void _lwip_enqueue_netif_status_msg(int16_t eventCode, struct netif *n)
 {
 	if (!n || !n->state) {
-		return NULL;
+		_enqueueEvent(eventCode, NULL);
+		return;
 	}
 	VirtualTap *tap = (VirtualTap*)(n->state);
-	struct zts_netif_details *ifd = new zts_netif_details;
-	ifd->nwid = tap->_nwid;
-	ifd->mtu = n->mtu;
-	memcpy(&(ifd->mac), n->hwaddr, n->hwaddr_len);
-	ifd->mac = htonll(ifd->mac) >> 16;
-	return ifd;
+	struct zts_netif_details ifd;
+	memset(&ifd, 0, sizeof(ifd));
+	ifd.nwid = tap->_nwid;
+	ifd.mtu = n->mtu;
+	memcpy(&(ifd.mac), n->hwaddr, n->hwaddr_len);
+	ifd.mac = htonll(ifd.mac) >> 16;
+	_enqueueEvent(eventCode, &ifd);
 }
 
 static err_t _netif_init4(struct netif *n)
@@ -732,7 +936,7 @@ void _lwip_init_interface(void *tapref, const InetAddress &ip)
 		LOCK_TCPIP_CORE();
 		netif_add(n, &ip4, &netmask, &gw, (void*)vtap, _netif_init4, tcpip_input);
 		vtap->netif4 = (void*)n;
-		_enqueueEvent(ZTS_EVENT_NETIF_UP, (void*)_lwip_prepare_netif_status_msg(n));
+		_lwip_enqueue_netif_status_msg(ZTS_EVENT_NETIF_UP, n);
 		UNLOCK_TCPIP_CORE();
 		snprintf(macbuf, ZTS_MAC_ADDRSTRLEN, "%02x:%02x:%02x:%02x:%02x:%02x",
 			n->hwaddr[0], n->hwaddr[1], n->hwaddr[2],
@@ -765,7 +969,7 @@ void _lwip_init_interface(void *tapref, const InetAddress &ip)
 		netif_add_ip6_address(n,&ip6,NULL);
 		n->output_ip6 = ethip6_output;
 		UNLOCK_TCPIP_CORE();
-		_enqueueEvent(ZTS_EVENT_NETIF_UP, (void*)_lwip_prepare_netif_status_msg(n));
+		_lwip_enqueue_netif_status_msg(ZTS_EVENT_NETIF_UP, n);
 		snprintf(macbuf, ZTS_MAC_ADDRSTRLEN, "%02x:%02x:%02x:%02x:%02x:%02x",
 			n->hwaddr[0], n->hwaddr[1], n->hwaddr[2],
 			n->hwaddr[3], n->hwaddr[4], n->hwaddr[5]);
@@ -24,9 +24,20 @@
 
 #define ZTS_LWIP_DRIVER_THREAD_NAME "NetworkStackThread"
 
+// Default and upper limit for the number of inbound frames handed to the stack per lock hold
+#define ZTS_RX_BATCH_SIZE_DEFAULT   64
+#define ZTS_RX_BATCH_SIZE_MAX       1024
+
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include "MAC.hpp"
-#include "Phy.hpp"
-#include "Thread.hpp"
+#include "Mutex.hpp"
+
+#include "concurrentqueue.h"
+
+struct pbuf;
 
 namespace ZeroTier {
 
@@ -38,11 +49,12 @@ struct InetAddress;
 /**
  * A virtual tap device. The ZeroTier Node Service will create one per
  * joined network. It will be destroyed upon leave().
+ *
+ * Taps own no thread, inbound frames are delivered by whichever thread calls
+ * put()/flushRx() and outbound frames are drained by the service thread.
  */
 class VirtualTap
 {
-	friend class Phy<VirtualTap *>;
-
 public:
 	VirtualTap(
 		const char *homePath,
@@ -53,6 +65,7 @@ public:
 		const char *friendlyName,
 		void (*handler)(void *, void *, uint64_t, const MAC &,
 			const MAC &, unsigned int, unsigned int, const void *, unsigned int),
+		void (*txNotify)(void *),
 		void *arg);
 
 	~VirtualTap();
@@ -77,7 +90,6 @@ public:
 
 	/**
 	 * Adds an address to the user-space stack interface associated with this VirtualTap
-	 * - Starts VirtualTap main thread ONLY if successful
 	 */
 	bool addIp(const InetAddress &ip);
 
@@ -88,10 +100,24 @@ public:
 
 	/**
 	 * Presents data to the user-space stack
+	 * - Frames are queued and delivered in batches, see flushRx()
 	 */
 	void put(const MAC &from,const MAC &to,unsigned int etherType,const void *data,
 		unsigned int len);
 
+	/**
+	 * Delivers all queued inbound frames to the stack under a single core lock
+	 */
+	void flushRx();
+
+	/**
+	 * Moves all outbound frames queued by the stack onto the end of batch
+	 * - Ownership of each pbuf moves to the caller, see _lwip_eth_tx_submit()
+	 *
+	 * @return Number of frames moved
+	 */
+	size_t dequeueTx(std::vector<struct pbuf *> &batch);
+
 	/**
 	 * Get VirtualTap device name (e.g. 'libzt17d72843bc2c5760')
 	 */
@@ -113,12 +139,6 @@ public:
 	 */
 	void setMtu(unsigned int mtu);
 
-	/**
-	 * Calls main network stack loops
-	 */
-	void threadMain()
-		throw();
-
 //#if defined(__MINGW32__)
 #if 0
 	/* The following is merely to make ZeroTier's OneService happy while building on Windows.
@@ -140,6 +160,17 @@ public:
 	void (*_handler)(void *, void *, uint64_t, const MAC &, const MAC &, unsigned int, unsigned int,
 		const void *, unsigned int);
 
+	/**
+	 * Called (with _arg) when the outbound queue goes from empty to non-empty
+	 */
+	void (*_txNotify)(void *);
+
+	/**
+	 * Outbound frames queued by the stack, drained by the service thread
+	 */
+	moodycamel::ConcurrentQueue<struct pbuf *> _txQueue;
+	std::atomic<bool> _txPending;
+
 	void *netif4 = NULL;
 	void *netif6 = NULL;
 
@@ -163,35 +194,20 @@ public:
 	void *_arg;
 	volatile bool _initialized;
 	volatile bool _enabled;
-	volatile bool _run;
 	MAC _mac;
 	unsigned int _mtu;
 	uint64_t _nwid;
-	PhySocket *_unixListenSocket;
-	Phy<VirtualTap *> _phy;
-
-	Thread _thread;
-
-	int _shutdownSignalPipe[2];
 
 	std::string _dev; // path to Unix domain socket
 
 	std::vector<MulticastGroup> _multicastGroups;
 	Mutex _multicastGroups_m;
 
-	//////////////////////////////////////////////////////////////////////////////
-	// Not used in this implementation                                          //
-	//////////////////////////////////////////////////////////////////////////////
-
-	void phyOnDatagram(PhySocket *sock,void **uptr,const struct sockaddr *local_address,
-		const struct sockaddr *from,void *data,unsigned long len);
-	void phyOnTcpConnect(PhySocket *sock,void **uptr,bool success);
-	void phyOnTcpAccept(PhySocket *sockL,PhySocket *sockN,void **uptrL,void **uptrN,
-		const struct sockaddr *from);
-	void phyOnTcpClose(PhySocket *sock,void **uptr);
-	void phyOnTcpData(PhySocket *sock,void **uptr,void *data,unsigned long len);
-	void phyOnTcpWritable(PhySocket *sock,void **uptr);
-	void phyOnUnixClose(PhySocket *sock,void **uptr);
+	/**
+	 * Inbound frames waiting to be delivered to the stack
+	 */
+	std::vector<struct pbuf *> _rxBatch;
+	Mutex _rxBatch_m;
 };
 
 /**
@@ -201,6 +217,28 @@ public:
  */
 bool _lwip_is_netif_up(void *netif);
 
+/**
+ * @brief Get the resolved ARP entries (static ones included) of a netif
+ *
+ * @param netif IPv4 netif of a virtual tap (VirtualTap::netif4)
+ * @param entries Appended with the IP address and MAC of each entry
+ */
+void _lwip_get_arp_entries(void *netif, std::vector<std::pair<InetAddress,MAC> > &entries);
+
+/**
+ * @brief Add a static ARP entry, on the netif whose network contains ip
+ *
+ * @usage Static entries are never refreshed or replaced by ARP replies, remove
+ * them with _lwip_remove_static_arp_entry() once they are no longer needed
+ * @return Whether the entry was added (false if no netif is on its network)
+ */
+bool _lwip_add_static_arp_entry(const InetAddress &ip, const MAC &mac);
+
+/**
+ * @brief Remove a static ARP entry, the address is then resolved with ARP again
+ */
+void _lwip_remove_static_arp_entry(const InetAddress &ip);
+
 /**
  * @brief Increase the delay multiplier for the main driver loop
  *
@@ -221,20 +259,18 @@ void _lwip_wake_driver();
 bool _lwip_is_up();
 
 /**
- * @brief Initialize network stack semaphores, threads, and timers.
+ * @brief Start the stack driver thread, and lwIP's tcpip thread the first time
  *
- * @usage This is called during the initial setup of each VirtualTap but is only allowed to execute once
- * @return
+ * @usage Called by zts_start(), does nothing while the driver is already running
  */
 void _lwip_driver_init();
 
 /**
- * @brief Shutdown the stack as completely as possible (not officially supported by lwIP)
+ * @brief Stop the stack driver thread and mark the stack as down
  *
- * @usage This is to be called after it is determined that no further network activity will take place.
- * The tcpip thread will be stopped, all interfaces will be brought down and all resources will
- * be deallocated. A full application restart will be required to bring the stack back online.
- * @return
+ * @usage Called by zts_free() once the service has exited. Returns once the driver
+ * thread has exited. lwIP can't stop its tcpip thread, it stays and is reused if
+ * _lwip_driver_init() brings the stack back up.
  */
 void _lwip_driver_shutdown();
 
@@ -298,26 +334,51 @@ void _lwip_init_interface(void *tapref, const InetAddress &ip);
  * @brief Called from the stack, outbound ethernet frames from the network stack enter the ZeroTier virtual wire here.
  *
  * @usage This shall only be called from the stack or the stack driver. Not the application thread.
+ * The frame is only referenced and queued on the VirtualTap, the service thread sends it.
  * @param netif Transmits an outgoing Ethernet fram from the network stack onto the ZeroTier virtual wire
  * @param p A pointer to the beginning of a chain pf struct pbufs
  * @return
  */
 err_t _lwip_eth_tx(struct netif *netif, struct pbuf *p);
 
+/**
+ * @brief Hands frames dequeued by VirtualTap::dequeueTx() to the ZeroTier core and
+ * releases them
+ *
+ * @usage Called from the service thread, the stack's core lock must not be held
+ * @param handler Frame handler used to move data onto the ZeroTier virtual wire
+ * @param arg Argument passed to handler
+ * @param nwids Network ID of each frame in batch
+ * @param batch Frames to send, cleared on return
+ */
+void _lwip_eth_tx_submit(void (*handler)(void *, void *, uint64_t, const MAC &, const MAC &,
+	unsigned int, unsigned int, const void *, unsigned int), void *arg,
+	std::vector<uint64_t> &nwids, std::vector<struct pbuf *> &batch);
+
 /**
  * @brief Receives incoming Ethernet frames from the ZeroTier virtual wire
  *
- * @usage This shall be called from the VirtualTap's I/O thread (via VirtualTap::put())
+ * @usage This shall be called from the thread delivering the frame (via VirtualTap::put()). The
+ * stack's core lock is not required.
  * @param tap Pointer to VirtualTap from which this data comes
  * @param from Origin address (virtual ZeroTier hardware address)
  * @param to Intended destination address (virtual ZeroTier hardware address)
  * @param etherType Protocol type
  * @param data Pointer to Ethernet frame
  * @param len Length of Ethernet frame
- * @return
+ * @return A pbuf ready to be passed to _lwip_eth_input(), or NULL if the frame was dropped
+ */
+struct pbuf *_lwip_eth_rx(VirtualTap *tap, const MAC &from, const MAC &to,
+	unsigned int etherType, const void *data, unsigned int len);
+
+/**
+ * @brief Feeds a frame prepared by _lwip_eth_rx() into the appropriate netif
+ *
+ * @usage The caller must hold the stack's core lock (via VirtualTap::flushRx())
+ * @param tap Pointer to VirtualTap from which this data comes
+ * @param p Frame to deliver, ownership is transferred to the stack
  */
-void _lwip_eth_rx(VirtualTap *tap, const MAC &from, const MAC &to, unsigned int etherType,
-	const void *data, unsigned int len);
+void _lwip_eth_input(VirtualTap *tap, struct pbuf *p);
 
 } // namespace ZeroTier
 
@@ -93,12 +93,14 @@
 #define MEMP_NUM_TCPIP_MSG_API          1024
 #define MEMP_NUM_TCPIP_MSG_INPKT        1024
 #define PBUF_POOL_SIZE                  1024
+#define LWIP_SUPPORT_CUSTOM_PBUF        1
 #define TCP_DEFAULT_LISTEN_BACKLOG      0xff
 // arp
 #define ARP_TABLE_SIZE                  64
 #define ARP_MAXAGE                      300
 #define ARP_QUEUEING                    1
 #define ARP_QUEUE_LEN                   3
+#define ETHARP_SUPPORT_STATIC_ENTRIES   1
 // ip
 #define IP_REASS_MAXAGE                 15
 #define IP_REASS_MAX_PBUFS              32
@@ -126,7 +128,8 @@
 // netif
 #define LWIP_SINGLE_NETIF               0
 #define LWIP_NETIF_HWADDRHINT           1
-#define LWIP_NETIF_TX_SINGLE_PBUF       0
+// Build outgoing TCP segments in one pbuf so they can be handed to the core without a copy
+#define LWIP_NETIF_TX_SINGLE_PBUF       1
 #define TCPIP_THREAD_PRIO               1
 
 #define LWIP_ASSERT_CORE_LOCKED() sys_check_core_locking()